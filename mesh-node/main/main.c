@@ -9,6 +9,7 @@
 #include "freertos/queue.h"
 #include "freertos/task.h"
 #include "led_indicator.h"
+#include "mesh_frag.h"
 #include "mesh_node.h"
 #include "sdkconfig.h"
 
@@ -29,6 +30,8 @@
 #define RESET_BUTTON 4
 #define RESET_BIT    6
 
+#define COMMAND_SEQ_LRU_SIZE 16
+
 #define RELAY_MASK                                                             \
     (1ULL << RELAY_1) | (1ULL << RELAY_2) | (1ULL << RELAY_3) |                \
         (1ULL << RELAY_4) | (1ULL << RELAY_5) | (1ULL << RELAY_6)
@@ -74,6 +77,8 @@ void           define_devices() {
 }
 
 static EventGroupHandle_t event_group;
+static uint32_t           recent_seqs[COMMAND_SEQ_LRU_SIZE];
+static uint8_t            recent_seq_count = 0;
 
 static void IRAM_ATTR     gpio_isr_handler(void* arg) {
     uint32_t gpio_num = (uint32_t)arg;
@@ -241,8 +246,13 @@ void turn_all_on() {
 }
 
 void turn_all_off() {
+    char temp[10];
     for (uint8_t i = 0; i < MAX_DEVICES; i++) {
-        if (device_list[i].device_state) turn_off(device_list[i].relay_io);
+        if (device_list[i].device_state == 1) {
+            turn_off(device_list[i].relay_io);
+            sprintf(temp, "relay_%d", i + 1);
+            device_set_channel_value(temp, &(device_list[i].device_state));
+        }
     }
 }
 
@@ -260,12 +270,131 @@ void create_device_channel() {
     }
 }
 
-static void mesh_node_receive(void* arg) {
+/* {"action":"group","op":"join"|"leave","groupID":"01005E......"} */
+static void group_action_handler(cJSON* data) {
+    cJSON* op       = cJSON_GetObjectItem(data, "op");
+    cJSON* group_id = cJSON_GetObjectItem(data, "groupID");
+    if (!cJSON_IsString(op) || !cJSON_IsString(group_id) ||
+        strlen(group_id->valuestring) != 12)
+        return;
+
+    mesh_addr_t  group_addr;
+    unsigned int bytearray[6];
+    for (int i = 0; i < 6; i++) {
+        sscanf(group_id->valuestring + 2 * i, "%02X", &bytearray[i]);
+        group_addr.addr[i] = bytearray[i];
+    }
+    if (strcmp(op->valuestring, "join") == 0) {
+        node_group_join(&group_addr);
+    } else if (strcmp(op->valuestring, "leave") == 0) {
+        node_group_leave(&group_addr);
+    }
+}
+
+static void apply_channels(cJSON* channels) {
+    cJSON* relay_state = NULL;
+    char   relay_temp[10];
+    for (uint8_t i = 0; i < MAX_DEVICES; i++) {
+        sprintf(relay_temp, "relay_%d", i + 1);
+        relay_state = cJSON_GetObjectItem(channels, relay_temp);
+        if (cJSON_IsBool(relay_state)) {
+            if (relay_state->valueint) {
+                turn_on(device_list[i].relay_io);
+            } else {
+                turn_off(device_list[i].relay_io);
+            }
+            device_set_channel_value(relay_temp,
+                                     &(device_list[i].device_state));
+        }
+    }
+}
+
+/* Most recently used first, a sequence number found here was applied */
+static bool command_seq_seen(uint32_t seq) {
+    uint8_t i = 0;
+    while (i < recent_seq_count && recent_seqs[i] != seq) i++;
+    bool seen = i < recent_seq_count;
+    if (!seen) {
+        if (recent_seq_count < COMMAND_SEQ_LRU_SIZE) recent_seq_count++;
+        i = recent_seq_count - 1;
+    }
+    memmove(&recent_seqs[1], &recent_seqs[0], i * sizeof(recent_seqs[0]));
+    recent_seqs[0] = seq;
+    return seen;
+}
+
+/* {"action":"command","seq":n,"merged":[m,..],"channels":{..}}, applied
+ * once even if the frame is delivered again, and acknowledged to the root
+ * every time. Commands the root merged into the frame are remembered as
+ * well, so a later retry of one of them alone is a duplicate */
+static void command_action_handler(cJSON* data) {
+    char   ack[64];
+    cJSON* seq      = cJSON_GetObjectItem(data, "seq");
+    cJSON* merged   = cJSON_GetObjectItem(data, "merged");
+    cJSON* channels = cJSON_GetObjectItem(data, "channels");
+    cJSON* item;
+    if (!cJSON_IsNumber(seq) || !cJSON_IsObject(channels)) return;
+
+    uint32_t seq_value = (uint32_t)seq->valuedouble;
+    bool     duplicate = command_seq_seen(seq_value);
+    cJSON_ArrayForEach(item, merged) {
+        if (!cJSON_IsNumber(item)) continue;
+        if (!command_seq_seen((uint32_t)item->valuedouble)) duplicate = false;
+    }
+    if (!duplicate) apply_channels(channels);
+    sprintf(ack, "{\"action\":\"ack\",\"seq\":%u,\"status\":\"%s\"}",
+            (unsigned)seq_value, duplicate ? "duplicate" : "applied");
+    send_to_root(ack, TRAFFIC_CLASS_COMMAND);
+    if (!duplicate) node_telemetry();
+}
+
+/* {"action":"ping","seq":n} from the root, answered at once with "pong" */
+static void ping_action_handler(cJSON* data) {
+    char   pong[40];
+    cJSON* seq = cJSON_GetObjectItem(data, "seq");
+    if (!cJSON_IsNumber(seq)) return;
+    sprintf(pong, "{\"action\":\"pong\",\"seq\":%d}", seq->valueint);
+    send_to_root(pong, TRAFFIC_CLASS_COMMAND);
+}
+
+/* {"action":"congestion","level":n} broadcast by the root */
+static void congestion_action_handler(cJSON* data) {
+    cJSON* level = cJSON_GetObjectItem(data, "level");
+    if (cJSON_IsNumber(level) && level->valueint >= 0) {
+        node_set_congestion(level->valueint);
+    }
+}
+
+/* Block until a whole message arrives, fragments are reassembled.
+ * Emergency frames are applied on the spot and not returned */
+static char* mesh_node_recv_msg(mesh_data_t* recv_data, bool* allocated) {
     mesh_addr_t src;
+    int         flag = 0;
+    char*       msg  = NULL;
+    while (msg == NULL) {
+        recv_data->size = MESH_MPS;
+        if (esp_mesh_recv(&src, recv_data, portMAX_DELAY, &flag, NULL, 0) ==
+            ESP_OK) {
+            msg = mesh_frag_receive(&src, recv_data, allocated);
+        }
+        /* Handled here so it works before provisioning and never waits
+         * behind other messages */
+        if (msg != NULL && strcmp(msg, EMERGENCY_ALL_OFF_FRAME) == 0) {
+            printf("Emergency all-off\n");
+            turn_all_off();
+            node_telemetry();
+            if (*allocated) free(msg);
+            msg = NULL;
+        }
+    }
+    return msg;
+}
+
+static void mesh_node_receive(void* arg) {
     mesh_data_t recv_data;
-    esp_err_t   err;
-    int         flag            = 0;
-    uint8_t     init_data[1024] = {0};
+    uint8_t     init_data[MESH_FRAG_RX_BUF_SIZE] = {0};
+    char*       msg;
+    bool        allocated;
     cJSON*      data;
     cJSON*      action;
     recv_data.data = init_data;
@@ -273,54 +402,49 @@ static void mesh_node_receive(void* arg) {
     nvs_get_u8(nvs_handler, "is_provisioned", &is_provisioned);
     if (!is_provisioned) {
         for (;;) {
-            memset(recv_data.data, 0x00, 1024);
-            recv_data.size = 1024;
-            err =
-                esp_mesh_recv(&src, &recv_data, portMAX_DELAY, &flag, NULL, 0);
-            if (err == ESP_OK) {
-                data   = cJSON_Parse((char*)(recv_data.data));
-                action = cJSON_GetObjectItem(data, "action");
-                if (cJSON_IsString(action)) {
-                    if (strcmp(action->valuestring, "provision") == 0) {
-                        ESP_ERROR_CHECK(
-                            nvs_set_u8(nvs_handler, "is_provisioned", 1));
-                        ESP_ERROR_CHECK(nvs_commit(nvs_handler));
-                        node_set_is_provisioned(true);
-                        break;
-                    }
-                }
-                if (cJSON_IsObject(data)) {
+            msg  = mesh_node_recv_msg(&recv_data, &allocated);
+            data = cJSON_Parse(msg);
+            if (allocated) free(msg);
+            action = cJSON_GetObjectItem(data, "action");
+            if (cJSON_IsString(action)) {
+                if (strcmp(action->valuestring, "provision") == 0) {
+                    ESP_ERROR_CHECK(
+                        nvs_set_u8(nvs_handler, "is_provisioned", 1));
+                    ESP_ERROR_CHECK(nvs_commit(nvs_handler));
+                    node_set_is_provisioned(true);
                     cJSON_Delete(data);
+                    break;
                 }
             }
+            if (cJSON_IsObject(data)) {
+                cJSON_Delete(data);
+            }
         }
     }
     printf("Start command reading\n");
-    cJSON* relay_state = NULL;
-    char   relay_temp[10];
     for (;;) {
-        memset(recv_data.data, 0x00, 1024);
-        recv_data.size = 1024;
-        err = esp_mesh_recv(&src, &recv_data, portMAX_DELAY, &flag, NULL, 0);
-        if (err == ESP_OK) {
-            data = cJSON_Parse((char*)(recv_data.data));
-            for (uint8_t i = 0; i < MAX_DEVICES; i++) {
-                sprintf(relay_temp, "relay_%d", i + 1);
-                relay_state = cJSON_GetObjectItem(data, relay_temp);
-                if (cJSON_IsBool(relay_state)) {
-                    if (relay_state->valueint) {
-                        turn_on(device_list[i].relay_io);
-                    } else {
-                        turn_off(device_list[i].relay_io);
-                    }
-                    device_set_channel_value(relay_temp,
-                                             &(device_list[i].device_state));
-                }
-            }
-            if (cJSON_IsObject(data)) {
-                node_telemetry();
-                cJSON_Delete(data);
+        msg  = mesh_node_recv_msg(&recv_data, &allocated);
+        data = cJSON_Parse(msg);
+        if (allocated) free(msg);
+        action = cJSON_GetObjectItem(data, "action");
+        if (cJSON_IsString(action)) {
+            if (strcmp(action->valuestring, "command") == 0) {
+                command_action_handler(data);
+            } else if (strcmp(action->valuestring, "ping") == 0) {
+                ping_action_handler(data);
+            } else if (strcmp(action->valuestring, "group") == 0) {
+                group_action_handler(data);
+            } else if (strcmp(action->valuestring, "congestion") == 0) {
+                congestion_action_handler(data);
             }
+            cJSON_Delete(data);
+            continue;
+        }
+        /* Untracked group and broadcast commands are bare channel objects */
+        if (cJSON_IsObject(data)) {
+            apply_channels(data);
+            node_telemetry();
+            cJSON_Delete(data);
         }
     }
 }
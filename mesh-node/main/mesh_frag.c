@@ -0,0 +1,188 @@
+#include "mesh_frag.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+/* Per message reassembly context, fragments may arrive in any order */
+typedef struct {
+    bool        in_use;
+    mesh_addr_t src;
+    uint16_t    msg_id;
+    uint16_t    total_len;
+    uint8_t     count;
+    uint32_t    received;
+    int64_t     start_us;
+    char*       buf;
+} mesh_frag_ctx_t;
+
+static const char*       TAG = "mesh_frag";
+static mesh_frag_ctx_t   frag_ctx[MESH_FRAG_MAX_CONTEXTS];
+static size_t            frag_mem_used = 0;
+static mesh_frag_stats_t frag_stats;
+static uint16_t          next_msg_id = 0;
+static portMUX_TYPE      frag_lock   = portMUX_INITIALIZER_UNLOCKED;
+
+esp_err_t mesh_frag_send(const mesh_addr_t* to,
+                         const char*        data,
+                         size_t             len,
+                         mesh_tos_t         tos,
+                         int                flag) {
+    mesh_data_t send_data;
+    send_data.proto = MESH_PROTO_BIN;
+    send_data.tos   = tos;
+
+    /* Fast path, the frame goes out as is */
+    if (len <= MESH_MPS && (len == 0 || (uint8_t)data[0] != MESH_FRAG_MAGIC)) {
+        send_data.data = (uint8_t*)data;
+        send_data.size = len;
+        return esp_mesh_send(to, &send_data, flag, NULL, 0);
+    }
+
+    uint8_t count = (len + MESH_FRAG_PAYLOAD - 1) / MESH_FRAG_PAYLOAD;
+    if (len > MESH_FRAG_MAX_MSG_SIZE || count > MESH_FRAG_MAX_COUNT) {
+        ESP_LOGW(TAG, "Message of %u bytes is too large", (unsigned)len);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t* frame = malloc(MESH_MPS);
+    if (frame == NULL) return ESP_ERR_NO_MEM;
+
+    mesh_frag_hdr_t* hdr = (mesh_frag_hdr_t*)frame;
+    hdr->magic           = MESH_FRAG_MAGIC;
+    hdr->count           = count;
+    hdr->reserved        = 0;
+    hdr->total_len       = len;
+    portENTER_CRITICAL(&frag_lock);
+    hdr->msg_id = next_msg_id++;
+    frag_stats.fragmented++;
+    portEXIT_CRITICAL(&frag_lock);
+
+    esp_err_t err = ESP_OK;
+    for (uint8_t i = 0; i < count && err == ESP_OK; i++) {
+        size_t offset = i * MESH_FRAG_PAYLOAD;
+        size_t size   = len - offset;
+        if (size > MESH_FRAG_PAYLOAD) size = MESH_FRAG_PAYLOAD;
+        hdr->index = i;
+        memcpy(frame + sizeof(mesh_frag_hdr_t), data + offset, size);
+        send_data.data = frame;
+        send_data.size = sizeof(mesh_frag_hdr_t) + size;
+        err            = esp_mesh_send(to, &send_data, flag, NULL, 0);
+    }
+    free(frame);
+    return err;
+}
+
+static void mesh_frag_release(mesh_frag_ctx_t* ctx) {
+    free(ctx->buf);
+    frag_mem_used -= ctx->total_len + 1;
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+static void mesh_frag_expire(int64_t now) {
+    for (uint8_t i = 0; i < MESH_FRAG_MAX_CONTEXTS; i++) {
+        if (frag_ctx[i].in_use &&
+            now - frag_ctx[i].start_us > MESH_FRAG_TIMEOUT_MS * 1000LL) {
+            ESP_LOGW(TAG, "Reassembly timeout from " MACSTR ", %d/%d",
+                     MAC2STR(frag_ctx[i].src.addr),
+                     __builtin_popcount(frag_ctx[i].received),
+                     frag_ctx[i].count);
+            frag_stats.timeouts++;
+            mesh_frag_release(&frag_ctx[i]);
+        }
+    }
+}
+
+/* Find the context of (src, msg_id) or start a new one within the memory
+ * cap. Fragments of several messages of one source may interleave, a
+ * context only ends complete or by MESH_FRAG_TIMEOUT_MS. With no room the
+ * new message is dropped, messages in progress are kept */
+static mesh_frag_ctx_t* mesh_frag_get_ctx(const mesh_addr_t*     src,
+                                          const mesh_frag_hdr_t* hdr,
+                                          int64_t                now) {
+    mesh_frag_ctx_t* free_ctx = NULL;
+    for (uint8_t i = 0; i < MESH_FRAG_MAX_CONTEXTS; i++) {
+        mesh_frag_ctx_t* ctx = &frag_ctx[i];
+        if (!ctx->in_use) {
+            if (free_ctx == NULL) free_ctx = ctx;
+        } else if (ctx->msg_id == hdr->msg_id &&
+                   memcmp(ctx->src.addr, src->addr, 6) == 0) {
+            return ctx;
+        }
+    }
+
+    size_t need = hdr->total_len + 1;
+    if (free_ctx == NULL || frag_mem_used + need > MESH_FRAG_MEM_CAP) {
+        ESP_LOGW(TAG, "No room to reassemble from " MACSTR "",
+                 MAC2STR(src->addr));
+        return NULL;
+    }
+
+    free_ctx->buf = malloc(need);
+    if (free_ctx->buf == NULL) return NULL;
+    free_ctx->in_use    = true;
+    free_ctx->src       = *src;
+    free_ctx->msg_id    = hdr->msg_id;
+    free_ctx->total_len = hdr->total_len;
+    free_ctx->count     = hdr->count;
+    free_ctx->received  = 0;
+    free_ctx->start_us  = now;
+    frag_mem_used += need;
+    return free_ctx;
+}
+
+char* mesh_frag_receive(const mesh_addr_t* src,
+                        mesh_data_t*       recv_data,
+                        bool*              allocated) {
+    *allocated = false;
+    if (recv_data->size == 0) return NULL;
+
+    /* Fast path, a whole message is used in place */
+    if (recv_data->data[0] != MESH_FRAG_MAGIC) {
+        recv_data->data[recv_data->size] = '\0';
+        return (char*)recv_data->data;
+    }
+
+    int64_t now = esp_timer_get_time();
+    mesh_frag_expire(now);
+
+    if (recv_data->size < sizeof(mesh_frag_hdr_t)) {
+        frag_stats.dropped++;
+        return NULL;
+    }
+    mesh_frag_hdr_t* hdr    = (mesh_frag_hdr_t*)recv_data->data;
+    size_t           len    = recv_data->size - sizeof(mesh_frag_hdr_t);
+    size_t           offset = hdr->index * MESH_FRAG_PAYLOAD;
+    if (hdr->count == 0 || hdr->count > MESH_FRAG_MAX_COUNT ||
+        hdr->index >= hdr->count || hdr->total_len > MESH_FRAG_MAX_MSG_SIZE ||
+        offset + len > hdr->total_len) {
+        frag_stats.dropped++;
+        return NULL;
+    }
+
+    mesh_frag_ctx_t* ctx = mesh_frag_get_ctx(src, hdr, now);
+    if (ctx == NULL || ctx->total_len != hdr->total_len ||
+        ctx->count != hdr->count) {
+        frag_stats.dropped++;
+        return NULL;
+    }
+
+    memcpy(ctx->buf + offset, recv_data->data + sizeof(mesh_frag_hdr_t), len);
+    ctx->received |= 1UL << hdr->index;
+    if (ctx->received != (uint32_t)((1ULL << ctx->count) - 1)) return NULL;
+
+    /* Complete, hand the buffer over to the caller */
+    char* msg           = ctx->buf;
+    msg[ctx->total_len] = '\0';
+    ctx->buf            = NULL;
+    frag_mem_used -= ctx->total_len + 1;
+    memset(ctx, 0, sizeof(*ctx));
+    frag_stats.reassembled++;
+    *allocated = true;
+    return msg;
+}
+
+void mesh_frag_get_stats(mesh_frag_stats_t* stats) { *stats = frag_stats; }
@@ -0,0 +1,47 @@
+#pragma once
+#include "esp_mesh.h"
+
+#define MESH_FRAG_MAGIC        0xF7
+#define MESH_FRAG_MAX_COUNT    32
+#define MESH_FRAG_MAX_MSG_SIZE 16384
+#define MESH_FRAG_MEM_CAP      24576
+#define MESH_FRAG_MAX_CONTEXTS 4
+#define MESH_FRAG_TIMEOUT_MS   3000
+
+/* Receive buffer size, one byte more than a mesh frame for the terminator */
+#define MESH_FRAG_RX_BUF_SIZE  (MESH_MPS + 1)
+
+typedef struct {
+    uint8_t  magic;
+    uint8_t  index;
+    uint8_t  count;
+    uint8_t  reserved;
+    uint16_t msg_id;
+    uint16_t total_len;
+} __attribute__((packed)) mesh_frag_hdr_t;
+
+#define MESH_FRAG_PAYLOAD (MESH_MPS - sizeof(mesh_frag_hdr_t))
+
+typedef struct {
+    uint32_t fragmented;
+    uint32_t reassembled;
+    uint32_t timeouts;
+    uint32_t dropped;
+} mesh_frag_stats_t;
+
+/* Send data as one mesh frame when it fits, otherwise as fragments */
+esp_err_t mesh_frag_send(const mesh_addr_t* to,
+                         const char*        data,
+                         size_t             len,
+                         mesh_tos_t         tos,
+                         int                flag);
+
+/* Handle a received frame (buffer of MESH_FRAG_RX_BUF_SIZE bytes).
+ * Whole frames are terminated and returned in place, a completed fragmented
+ * message is returned as a heap buffer with *allocated set, the caller frees
+ * it. Returns NULL while a message is still incomplete */
+char*     mesh_frag_receive(const mesh_addr_t* src,
+                            mesh_data_t*       recv_data,
+                            bool*              allocated);
+
+void      mesh_frag_get_stats(mesh_frag_stats_t* stats);
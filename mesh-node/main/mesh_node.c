@@ -10,10 +10,14 @@
 #include "esp_netif.h"
 #include "esp_smartconfig.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/event_groups.h"
+#include "freertos/task.h"
 #include "led_indicator.h"
+#include "mesh_frag.h"
 #include "nvs_flash.h"
+#include "traffic_class.h"
 
 // #define CONFIG_MESH_IE_CRYPTO_KEY "topsecret"
 #define CONFIG_MESH_NON_MESH_AP_CONNECTIONS 0
@@ -22,6 +26,10 @@
 #define CONFIG_MESH_AP_PASSWD               "topsecret"
 #define CONFIG_MESH_TOPOLOGY                0
 #define MESH_CONNECTED_BIT                  (1 << 15)
+#define NODE_MAX_GROUPS                     8
+#define NODE_CONGESTION_NONE                0
+#define NODE_CONGESTION_SEVERE              2
+#define NODE_CONGESTION_EXPIRE_MS           60000 /* 2x the root refresh */
 
 esp_netif_t *             sta_netif;
 uint8_t                   is_configured;
@@ -34,6 +42,94 @@ mesh_addr_t               mesh_parent_addr;
 int                       mesh_layer = -1;
 
 static EventGroupHandle_t event_group;
+static mesh_addr_t        group_ids[NODE_MAX_GROUPS];
+static uint8_t            group_count = 0;
+
+/* Minimum time between telemetry reports per congestion level */
+static const uint32_t     telemetry_interval_ms[] = {0, 5000, 30000};
+static TaskHandle_t       telemetry_task;
+static volatile bool      telemetry_pending  = false;
+static volatile bool      topology_pending   = false;
+/* Unthrottled until a root says otherwise or toDS is reported down */
+static uint8_t            root_congestion    = NODE_CONGESTION_NONE;
+static int64_t            root_congestion_us = 0;
+static bool               tods_reachable     = true;
+
+/* Tell the root where this node sits, it keeps the topology graph.
+ * The parent is known by its SoftAP BSSID, its station MAC is one less */
+static void node_send_topology(void) {
+    char    data[80];
+    uint8_t parent[6];
+    if (esp_mesh_is_root()) return;
+    /* 48-bit decrement, a 00 last byte borrows from the ones before */
+    memcpy(parent, mesh_parent_addr.addr, 6);
+    for (int i = 5; i >= 0; i--) {
+        if (parent[i]-- != 0) break;
+    }
+    sprintf(data,
+            "{\"action\":\"topology\",\"parent\":\"%02X%02X%02X%02X%02X%02X\","
+            "\"layer\":%d}",
+            MAC2STR(parent), mesh_layer);
+    mesh_frag_send(NULL, data, strlen(data), MESH_TOS_DEF,
+                   MESH_DATA_TODS | MESH_DATA_NONBLOCK);
+}
+
+/* The root level, or severe while the root cannot reach the server. The
+ * root repeats a raised level, one that is not repeated has ended even if
+ * the all-clear broadcast was lost */
+static uint8_t node_congestion_level(void) {
+    if (!tods_reachable) return NODE_CONGESTION_SEVERE;
+    if (root_congestion != NODE_CONGESTION_NONE &&
+        esp_timer_get_time() - root_congestion_us >
+            NODE_CONGESTION_EXPIRE_MS * 1000LL) {
+        ESP_LOGI("MESH", "Root congestion level expired");
+        root_congestion = NODE_CONGESTION_NONE;
+    }
+    return root_congestion;
+}
+
+/* Topology reports are not urgent, they wait until the mesh is calm */
+static void node_report_topology(void) {
+    topology_pending = true;
+    if (telemetry_task != NULL) xTaskNotifyGive(telemetry_task);
+}
+
+/* Sends the latest state when asked, but no more often than the congestion
+ * level allows. Reports coming in meanwhile are merged into one */
+static void node_telemetry_task(void *arg) {
+    int64_t last_sent_us = 0;
+    for (;;) {
+        uint8_t    level = node_congestion_level();
+        int64_t    now   = esp_timer_get_time();
+        TickType_t wait  = portMAX_DELAY;
+
+        if (telemetry_pending) {
+            int64_t due =
+                last_sent_us + telemetry_interval_ms[level] * 1000LL;
+            if (last_sent_us == 0 || now >= due) {
+                telemetry_pending = false;
+                char *str         = device_get_mqtt_state_json_data();
+                send_to_root(str, TRAFFIC_CLASS_TELEMETRY);
+                free(str);
+                last_sent_us = now;
+            } else {
+                wait = pdMS_TO_TICKS((due - now) / 1000) + 1;
+            }
+        }
+        if (topology_pending && level == NODE_CONGESTION_NONE) {
+            topology_pending = false;
+            node_send_topology();
+        }
+        /* Wake up when a raised level expires */
+        if (level != NODE_CONGESTION_NONE && tods_reachable) {
+            int64_t    expire_us = root_congestion_us +
+                                   NODE_CONGESTION_EXPIRE_MS * 1000LL - now;
+            TickType_t expire    = pdMS_TO_TICKS(expire_us / 1000) + 1;
+            if (expire < wait) wait = expire;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
 
 static void mesh_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
@@ -112,6 +208,7 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
                 esp_netif_dhcpc_stop(sta_netif);
                 esp_netif_dhcpc_start(sta_netif);
             }
+            node_report_topology();
         } break;
         case MESH_EVENT_PARENT_DISCONNECTED: {
             ind_led_set_state(IND_LED_WAIT_CONNECT_MESH);
@@ -120,6 +217,9 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
             ESP_LOGI(MESH_TAG, "<MESH_EVENT_PARENT_DISCONNECTED>reason:%d",
                      disconnected->reason);
             mesh_layer = esp_mesh_get_layer();
+            /* The next root may not be congested, a NONE level is not
+             * repeated so a stale one would never clear */
+            node_set_congestion(NODE_CONGESTION_NONE);
         } break;
         case MESH_EVENT_LAYER_CHANGE: {
             mesh_event_layer_change_t *layer_change =
@@ -131,6 +231,7 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
                      : (mesh_layer == 2) ? "<layer2>"
                                          : "");
             last_layer = mesh_layer;
+            node_report_topology();
         } break;
         case MESH_EVENT_ROOT_ADDRESS: {
             mesh_event_root_address_t *root_addr =
@@ -173,6 +274,8 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
                 (mesh_event_toDS_state_t *)event_data;
             ESP_LOGI(MESH_TAG, "<MESH_EVENT_TODS_REACHABLE>state:%d",
                      *toDs_state);
+            tods_reachable = *toDs_state == MESH_TODS_REACHABLE;
+            if (telemetry_task != NULL) xTaskNotifyGive(telemetry_task);
         } break;
         case MESH_EVENT_ROOT_FIXED: {
             mesh_event_root_fixed_t *root_fixed =
@@ -367,6 +470,8 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
 }
 
 void node_config(void) {
+    xTaskCreate(node_telemetry_task, "telemetry", 4096, NULL, 5,
+                &telemetry_task);
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     sta_netif = esp_netif_create_default_wifi_sta();
@@ -386,15 +491,19 @@ void node_config(void) {
     ESP_ERROR_CHECK(esp_wifi_start());
     xEventGroupWaitBits(event_group, MESH_CONNECTED_BIT, true, false,
                         portMAX_DELAY);
+
+    /* Rejoin the mesh groups assigned by the root */
+    size_t size = sizeof(group_ids);
+    if (nvs_get_blob(nvs_handler, "groups", group_ids, &size) == ESP_OK) {
+        group_count = size / sizeof(mesh_addr_t);
+        if (group_count) esp_mesh_set_group_id(group_ids, group_count);
+    }
 }
 
-void send_to_root(char *data) {
-    mesh_data_t send_data;
-    send_data.data  = (uint8_t *)data;
-    send_data.size  = strlen(data);
-    send_data.proto = MESH_PROTO_BIN;
-    send_data.tos   = MESH_DATA_FROMDS;
-    esp_mesh_send(NULL, &send_data, MESH_DATA_TODS, NULL, 0);
+esp_err_t send_to_root(char *data, traffic_class_t traffic_class) {
+    int flag = MESH_DATA_TODS | traffic_class_cfg[traffic_class].mesh_flag;
+    return mesh_frag_send(NULL, data, strlen(data),
+                          traffic_class_cfg[traffic_class].mesh_tos, flag);
 }
 
 void node_provision() {
@@ -402,7 +511,8 @@ void node_provision() {
     if (!is_provisioned) {
         while (!is_provisioned) {
             char *str = device_get_mqtt_provision_json_data();
-            send_to_root(str);
+            send_to_root(str, TRAFFIC_CLASS_PROVISION);
+            free(str);
             vTaskDelay(30000 / portTICK_PERIOD_MS);
         }
     }
@@ -411,6 +521,51 @@ void node_provision() {
 void node_set_is_provisioned(bool value) { is_provisioned = value; }
 
 void node_telemetry() {
-    char *str = device_get_mqtt_state_json_data();
-    send_to_root(str);
+    telemetry_pending = true;
+    if (telemetry_task != NULL) xTaskNotifyGive(telemetry_task);
+}
+
+void node_set_congestion(uint8_t level) {
+    if (level > NODE_CONGESTION_SEVERE) level = NODE_CONGESTION_SEVERE;
+    if (level != root_congestion) {
+        ESP_LOGI("MESH", "Root congestion level %d", level);
+    }
+    root_congestion    = level;
+    root_congestion_us = esp_timer_get_time();
+    if (telemetry_task != NULL) xTaskNotifyGive(telemetry_task);
+}
+
+static void node_group_save(void) {
+    if (group_count) {
+        esp_mesh_set_group_id(group_ids, group_count);
+        nvs_set_blob(nvs_handler, "groups", group_ids,
+                     group_count * sizeof(mesh_addr_t));
+    } else {
+        nvs_erase_key(nvs_handler, "groups");
+    }
+    nvs_commit(nvs_handler);
+}
+
+void node_group_join(mesh_addr_t *group_addr) {
+    for (uint8_t i = 0; i < group_count; i++) {
+        if (memcmp(group_ids[i].addr, group_addr->addr, 6) == 0) return;
+    }
+    if (group_count >= NODE_MAX_GROUPS) {
+        ESP_LOGW("GROUP", "Too many groups, cannot join " MACSTR "",
+                 MAC2STR(group_addr->addr));
+        return;
+    }
+    group_ids[group_count++] = *group_addr;
+    node_group_save();
+}
+
+void node_group_leave(mesh_addr_t *group_addr) {
+    for (uint8_t i = 0; i < group_count; i++) {
+        if (memcmp(group_ids[i].addr, group_addr->addr, 6) == 0) {
+            esp_mesh_delete_group_id(group_addr, 1);
+            group_ids[i] = group_ids[--group_count];
+            node_group_save();
+            return;
+        }
+    }
 }
\ No newline at end of file
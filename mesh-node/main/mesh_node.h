@@ -1,10 +1,15 @@
 #pragma once
+#include "esp_mesh.h"
 #include "nvs_flash.h"
+#include "traffic_class.h"
 
 extern nvs_handle_t nvs_handler;
 
 void                node_config(void);
-void                send_to_root(char* data);
+esp_err_t           send_to_root(char* data, traffic_class_t traffic_class);
 void                node_provision(void);
 void                node_set_is_provisioned(bool value);
-void                node_telemetry(void);
\ No newline at end of file
+void                node_telemetry(void);
+void                node_set_congestion(uint8_t level);
+void                node_group_join(mesh_addr_t* group_addr);
+void                node_group_leave(mesh_addr_t* group_addr);
\ No newline at end of file
@@ -0,0 +1,34 @@
+#include "traffic_class.h"
+
+/* Commands and provisioning are retransmitted hop by hop and never evicted,
+ * telemetry and logs may be dropped by a new root or by a full queue */
+const traffic_class_cfg_t traffic_class_cfg[TRAFFIC_CLASS_MAX] = {
+    [TRAFFIC_CLASS_COMMAND]   = {.name                = "command",
+                                 .mesh_tos            = MESH_TOS_P2P,
+                                 .mesh_flag           = 0,
+                                 .mqtt_qos            = 1,
+                                 .node_queue_depth    = 8,
+                                 .publish_queue_depth = 16,
+                                 .drop_policy         = TRAFFIC_DROP_NEWEST},
+    [TRAFFIC_CLASS_PROVISION] = {.name                = "provision",
+                                 .mesh_tos            = MESH_TOS_P2P,
+                                 .mesh_flag           = 0,
+                                 .mqtt_qos            = 1,
+                                 .node_queue_depth    = 2,
+                                 .publish_queue_depth = 4,
+                                 .drop_policy         = TRAFFIC_DROP_NEWEST},
+    [TRAFFIC_CLASS_TELEMETRY] = {.name                = "telemetry",
+                                 .mesh_tos            = MESH_TOS_DEF,
+                                 .mesh_flag           = MESH_DATA_DROP,
+                                 .mqtt_qos            = 1,
+                                 .node_queue_depth    = 4,
+                                 .publish_queue_depth = 32,
+                                 .drop_policy         = TRAFFIC_DROP_OLDEST},
+    [TRAFFIC_CLASS_LOG]       = {.name                = "log",
+                                 .mesh_tos            = MESH_TOS_DEF,
+                                 .mesh_flag           = MESH_DATA_DROP,
+                                 .mqtt_qos            = 0,
+                                 .node_queue_depth    = 2,
+                                 .publish_queue_depth = 8,
+                                 .drop_policy         = TRAFFIC_DROP_OLDEST},
+};
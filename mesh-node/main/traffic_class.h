@@ -0,0 +1,32 @@
+#pragma once
+#include "esp_mesh.h"
+
+/* Emergency all-off, broadcast by the root at the highest mesh priority and
+ * applied by nodes straight from the receive path */
+#define EMERGENCY_ALL_OFF_FRAME "{\"action\":\"all_off\"}"
+
+/* Traffic classes, ordered from highest to lowest priority */
+typedef enum {
+    TRAFFIC_CLASS_COMMAND,
+    TRAFFIC_CLASS_PROVISION,
+    TRAFFIC_CLASS_TELEMETRY,
+    TRAFFIC_CLASS_LOG,
+    TRAFFIC_CLASS_MAX
+} traffic_class_t;
+
+typedef enum {
+    TRAFFIC_DROP_NEWEST, /* Reject the new message when the queue is full */
+    TRAFFIC_DROP_OLDEST, /* Evict the oldest queued message of the class */
+} traffic_drop_policy_t;
+
+typedef struct {
+    const char*           name;
+    mesh_tos_t            mesh_tos;
+    int                   mesh_flag;
+    uint8_t               mqtt_qos;
+    uint8_t               node_queue_depth;    /* Per mesh destination */
+    uint8_t               publish_queue_depth; /* Root to MQTT */
+    traffic_drop_policy_t drop_policy;
+} traffic_class_cfg_t;
+
+extern const traffic_class_cfg_t traffic_class_cfg[TRAFFIC_CLASS_MAX];
@@ -0,0 +1,332 @@
+#include "broker_select.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "mesh_root.h"
+#include "nvs_flash.h"
+
+typedef struct {
+    char    uri[BROKER_URI_LEN];
+    int32_t latency_ms; /* Smoothed TCP connect time, -1 while unknown */
+    int32_t rtt_ms;     /* Smoothed PUBACK time while active, -1 if never */
+    uint8_t failures;   /* Failed sessions in a row */
+    int64_t retry_us;   /* Unhealthy until then */
+} broker_t;
+
+typedef struct {
+    int     msg_id;
+    uint8_t broker;
+    int64_t sent_us;
+} broker_rtt_slot_t;
+
+static const char*       TAG = "broker";
+static broker_t          brokers[BROKER_MAX];
+static uint8_t           broker_count   = 0;
+static uint8_t           active         = 0;
+static uint8_t           failback_votes = 0;
+static bool              connected      = false;
+static bool              switching      = false;
+static bool              measured       = false; /* active chosen by cost */
+static broker_rtt_slot_t rtt_slots[BROKER_RTT_SLOTS];
+static uint8_t           rtt_next = 0;
+static SemaphoreHandle_t broker_lock;
+
+/* Caller holds broker_lock */
+static bool broker_parse_list(const char* list) {
+    broker_t parsed[BROKER_MAX];
+    uint8_t  count = 0;
+    while (*list && count < BROKER_MAX) {
+        size_t len = strcspn(list, ",");
+        if (len > 0 && len < BROKER_URI_LEN) {
+            memset(&parsed[count], 0, sizeof(broker_t));
+            memcpy(parsed[count].uri, list, len);
+            parsed[count].latency_ms = -1;
+            parsed[count].rtt_ms     = -1;
+            count++;
+        }
+        list += len;
+        if (*list == ',') list++;
+    }
+    if (count == 0) return false;
+    memcpy(brokers, parsed, sizeof(parsed));
+    broker_count   = count;
+    active         = 0;
+    failback_votes = 0;
+    measured       = false;
+    memset(rtt_slots, 0, sizeof(rtt_slots));
+    return true;
+}
+
+static bool broker_healthy(const broker_t* broker, int64_t now) {
+    return broker->retry_us <= now;
+}
+
+/* Expected cost of a session in ms, one TCP connect plus one PUBACK round
+ * trip. A broker that was never active is assumed to answer a publish as
+ * fast as a connect. -1 while the connect time is unknown */
+static int32_t broker_cost(const broker_t* broker) {
+    if (broker->latency_ms < 0) return -1;
+    return broker->latency_ms +
+           (broker->rtt_ms >= 0 ? broker->rtt_ms : broker->latency_ms);
+}
+
+/* Cheapest healthy broker other than exclude, earlier entries win ties and
+ * unknown costs. BROKER_MAX if there is none */
+static uint8_t broker_best(int64_t now, uint8_t exclude) {
+    uint8_t best = BROKER_MAX;
+    for (uint8_t i = 0; i < broker_count; i++) {
+        if (i == exclude || !broker_healthy(&brokers[i], now)) continue;
+        int32_t cost = broker_cost(&brokers[i]);
+        if (best == BROKER_MAX ||
+            (cost >= 0 && (broker_cost(&brokers[best]) < 0 ||
+                           cost < broker_cost(&brokers[best]))))
+            best = i;
+    }
+    return best;
+}
+
+/* mqtt[s]://host[:port][/path], ws and wss as well */
+static bool broker_host_port(const char* uri, char* host, char* port) {
+    const char* scheme_end = strstr(uri, "://");
+    if (scheme_end == NULL) return false;
+    bool        ws     = strncmp(uri, "ws", 2) == 0;
+    bool        secure = strncmp(uri, "mqtts", 5) == 0 ||
+                         strncmp(uri, "wss", 3) == 0;
+    const char* start  = scheme_end + 3;
+    size_t      len    = strcspn(start, ":/");
+    if (len == 0 || len >= BROKER_URI_LEN) return false;
+    memcpy(host, start, len);
+    host[len] = '\0';
+    if (start[len] == ':') {
+        size_t port_len = strcspn(start + len + 1, "/");
+        if (port_len == 0 || port_len > 5) return false;
+        memcpy(port, start + len + 1, port_len);
+        port[port_len] = '\0';
+    } else {
+        strcpy(port, ws ? (secure ? "443" : "80") : (secure ? "8883" : "1883"));
+    }
+    return true;
+}
+
+/* TCP connect time to a broker in ms, -1 if it cannot be reached */
+static int32_t broker_probe(const char* uri) {
+    char             host[BROKER_URI_LEN];
+    char             port[6];
+    struct addrinfo  hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo* res   = NULL;
+    int32_t          ms    = -1;
+
+    if (!broker_host_port(uri, host, port)) return -1;
+    if (getaddrinfo(host, port, &hints, &res) != 0 || res == NULL) return -1;
+    int sock = socket(res->ai_family, res->ai_socktype, 0);
+    if (sock >= 0) {
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+        int64_t start = esp_timer_get_time();
+        if (connect(sock, res->ai_addr, res->ai_addrlen) == 0 ||
+            errno == EINPROGRESS) {
+            fd_set         fds;
+            struct timeval timeout = {
+                .tv_sec  = BROKER_PROBE_TIMEOUT_MS / 1000,
+                .tv_usec = (BROKER_PROBE_TIMEOUT_MS % 1000) * 1000,
+            };
+            int       err     = 0;
+            socklen_t err_len = sizeof(err);
+            FD_ZERO(&fds);
+            FD_SET(sock, &fds);
+            if (select(sock + 1, NULL, &fds, NULL, &timeout) == 1 &&
+                getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 &&
+                err == 0) {
+                ms = (esp_timer_get_time() - start) / 1000;
+            }
+        }
+        close(sock);
+    }
+    freeaddrinfo(res);
+    return ms;
+}
+
+/* Probe every broker, then move back to a clearly cheaper one once it has
+ * been cheaper for BROKER_FAILBACK_PROBES rounds. The first entry of a new
+ * list was not chosen by cost, it is left after one round. The first round
+ * runs at once and rounds stay short while a latency is unknown */
+static void broker_probe_task(void* arg) {
+    char uri[BROKER_URI_LEN];
+    for (;;) {
+        bool unknown = false;
+        for (uint8_t i = 0; i < BROKER_MAX; i++) {
+            xSemaphoreTake(broker_lock, portMAX_DELAY);
+            bool valid = i < broker_count;
+            if (valid) strcpy(uri, brokers[i].uri);
+            xSemaphoreGive(broker_lock);
+            if (!valid) break;
+
+            int32_t ms  = broker_probe(uri);
+            int64_t now = esp_timer_get_time();
+            xSemaphoreTake(broker_lock, portMAX_DELAY);
+            /* The list may have changed meanwhile */
+            if (i < broker_count && strcmp(uri, brokers[i].uri) == 0) {
+                broker_t* broker   = &brokers[i];
+                int64_t   retry_us = now + BROKER_PROBE_MS * 1000LL;
+                if (ms < 0) {
+                    /* Unhealthy at least until the next probe */
+                    if (broker->retry_us < retry_us)
+                        broker->retry_us = retry_us;
+                    if (broker->latency_ms < 0) unknown = true;
+                } else if (broker->latency_ms < 0) {
+                    broker->latency_ms = ms;
+                } else {
+                    broker->latency_ms = (broker->latency_ms * 3 + ms) / 4;
+                }
+            }
+            xSemaphoreGive(broker_lock);
+        }
+
+        bool    move = false;
+        int64_t now  = esp_timer_get_time();
+        xSemaphoreTake(broker_lock, portMAX_DELAY);
+        uint8_t best        = broker_best(now, active);
+        int32_t best_cost   = -1;
+        int32_t active_cost = broker_cost(&brokers[active]);
+        if (best != BROKER_MAX) best_cost = broker_cost(&brokers[best]);
+        if (connected && !switching && best_cost >= 0 && active_cost >= 0 &&
+            best_cost * 100 < active_cost * (100 - BROKER_FAILBACK_PCT)) {
+            failback_votes++;
+        } else {
+            failback_votes = 0;
+        }
+        if (failback_votes >= (measured ? BROKER_FAILBACK_PROBES : 1)) {
+            ESP_LOGI(TAG, "Move to %s, %dms instead of %dms",
+                     brokers[best].uri, best_cost, active_cost);
+            active         = best;
+            switching      = true;
+            failback_votes = 0;
+            strcpy(uri, brokers[active].uri);
+            move = true;
+        }
+        if (connected && !unknown) measured = true;
+        xSemaphoreGive(broker_lock);
+        if (move) mqtt_root_switch_broker(uri);
+
+        vTaskDelay(pdMS_TO_TICKS(unknown ? BROKER_PROBE_FAST_MS
+                                         : BROKER_PROBE_MS));
+    }
+}
+
+void broker_select_init(const char* default_list) {
+    char   list[BROKER_LIST_LEN];
+    size_t size = sizeof(list);
+    broker_lock = xSemaphoreCreateMutex();
+    if (nvs_get_str(nvs_handler, "brokers", list, &size) != ESP_OK ||
+        !broker_parse_list(list)) {
+        broker_parse_list(default_list);
+    }
+    xTaskCreate(broker_probe_task, "broker_probe", 3072, NULL, 2, NULL);
+}
+
+void broker_select_current(char* uri) {
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    strcpy(uri, brokers[active].uri);
+    xSemaphoreGive(broker_lock);
+}
+
+void broker_select_connected(void) {
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    brokers[active].failures = 0;
+    brokers[active].retry_us = 0;
+    connected                = true;
+    switching                = false;
+    xSemaphoreGive(broker_lock);
+}
+
+/* A planned move is not a failure. Otherwise the broker backs off longer
+ * with every failed session and the fastest healthy one takes over */
+bool broker_select_disconnected(bool link_up) {
+    bool move = false;
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    connected = false;
+    if (switching) {
+        switching = false;
+    } else if (link_up) {
+        int64_t   now    = esp_timer_get_time();
+        broker_t* broker = &brokers[active];
+        if (broker->failures < 8) broker->failures++;
+        broker->retry_us = now + BROKER_RETRY_MS * 1000LL * broker->failures;
+        uint8_t best     = broker_best(now, active);
+        if (best != BROKER_MAX) {
+            ESP_LOGW(TAG, "Fail over from %s to %s", broker->uri,
+                     brokers[best].uri);
+            active = best;
+            move   = true;
+        }
+    }
+    xSemaphoreGive(broker_lock);
+    return move;
+}
+
+void broker_select_sent(int msg_id) {
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    rtt_slots[rtt_next].msg_id  = msg_id;
+    rtt_slots[rtt_next].broker  = active;
+    rtt_slots[rtt_next].sent_us = esp_timer_get_time();
+    rtt_next                    = (rtt_next + 1) % BROKER_RTT_SLOTS;
+    xSemaphoreGive(broker_lock);
+}
+
+void broker_select_acked(int msg_id) {
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    for (uint8_t i = 0; i < BROKER_RTT_SLOTS; i++) {
+        if (rtt_slots[i].msg_id != msg_id || rtt_slots[i].sent_us == 0)
+            continue;
+        broker_t* broker = &brokers[rtt_slots[i].broker];
+        int32_t   ms =
+            (esp_timer_get_time() - rtt_slots[i].sent_us) / 1000;
+        broker->rtt_ms =
+            broker->rtt_ms < 0 ? ms : (broker->rtt_ms * 3 + ms) / 4;
+        rtt_slots[i].sent_us = 0;
+        break;
+    }
+    xSemaphoreGive(broker_lock);
+}
+
+bool broker_select_set_list(const char* list) {
+    char uri[BROKER_URI_LEN];
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    bool valid = broker_parse_list(list);
+    if (valid) {
+        switching = connected;
+        strcpy(uri, brokers[active].uri);
+    }
+    xSemaphoreGive(broker_lock);
+    if (!valid) return false;
+
+    nvs_set_str(nvs_handler, "brokers", list);
+    nvs_commit(nvs_handler);
+    mqtt_root_switch_broker(uri);
+    return true;
+}
+
+void broker_select_add_to_json(cJSON* array) {
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(broker_lock, portMAX_DELAY);
+    for (uint8_t i = 0; i < broker_count; i++) {
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "uri", brokers[i].uri);
+        cJSON_AddNumberToObject(item, "latency", brokers[i].latency_ms);
+        cJSON_AddNumberToObject(item, "rtt", brokers[i].rtt_ms);
+        cJSON_AddBoolToObject(item, "healthy",
+                              broker_healthy(&brokers[i], now));
+        if (i == active) cJSON_AddBoolToObject(item, "connected", connected);
+        cJSON_AddItemToArray(array, item);
+    }
+    xSemaphoreGive(broker_lock);
+}
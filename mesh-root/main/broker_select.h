@@ -0,0 +1,39 @@
+#pragma once
+#include <cJSON.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BROKER_MAX              4
+#define BROKER_URI_LEN          64
+#define BROKER_LIST_LEN         (BROKER_MAX * BROKER_URI_LEN)
+#define BROKER_PROBE_MS         15000 /* TCP connect probe of every broker */
+#define BROKER_PROBE_FAST_MS    2000  /* While a latency is still unknown */
+#define BROKER_PROBE_TIMEOUT_MS 2000
+#define BROKER_RETRY_MS         30000 /* Back off after a failed session */
+#define BROKER_FAILBACK_PCT     30    /* Required latency gain to move */
+#define BROKER_FAILBACK_PROBES  3     /* Consecutive probes showing it */
+#define BROKER_RTT_SLOTS        8
+
+/* Load the comma separated broker list from NVS, default_list if none is
+ * stored, and start probing the brokers */
+void        broker_select_init(const char* default_list);
+
+/* Copy the URI the client should connect to, uri holds BROKER_URI_LEN */
+void        broker_select_current(char* uri);
+
+/* Session events of the MQTT client. broker_select_disconnected() returns
+ * true when the client has to move to broker_select_current(). Without
+ * link_up the network is gone and the broker is not to blame */
+void        broker_select_connected(void);
+bool        broker_select_disconnected(bool link_up);
+
+/* PUBACK round trip of the current broker, msg_id of a QoS 1 publish */
+void        broker_select_sent(int msg_id);
+void        broker_select_acked(int msg_id);
+
+/* Replace the list at run time, it is kept in NVS */
+bool        broker_select_set_list(const char* list);
+
+/* {"uri","latency","rtt","healthy"} per broker, the current one with
+ * "connected" */
+void        broker_select_add_to_json(cJSON* array);
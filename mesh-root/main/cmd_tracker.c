@@ -0,0 +1,267 @@
+#include "cmd_tracker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mesh_root.h"
+
+typedef enum {
+    CMD_STATUS_PENDING,
+    CMD_STATUS_APPLIED,
+    CMD_STATUS_DUPLICATE,
+    CMD_STATUS_FAILED,
+    CMD_STATUS_TIMEOUT,
+} cmd_status_t;
+
+static const char* const cmd_status_names[] = {"pending", "applied",
+                                               "duplicate", "failed",
+                                               "timeout"};
+
+typedef struct {
+    bool    in_use;
+    bool    complete;  /* Every target was added */
+    uint8_t invalid;   /* Entries without a valid target */
+    uint8_t untracked; /* Sent, but no target slot was left */
+    char    id[CMD_TRACKER_ID_LEN];
+    int64_t deadline_us;
+} cmd_entry_t;
+
+typedef struct {
+    bool         in_use;
+    uint8_t      cmd;
+    mesh_addr_t  addr;
+    uint32_t     seq;
+    cmd_status_t status;
+} cmd_target_t;
+
+static const char*       TAG = "cmd_tracker";
+static cmd_entry_t       commands[CMD_TRACKER_MAX_COMMANDS];
+static cmd_target_t      targets[CMD_TRACKER_MAX_TARGETS];
+static SemaphoreHandle_t tracker_lock;
+
+/* Publish and release a command once no target is pending. Returns the
+ * result to publish, caller holds tracker_lock */
+static char* cmd_tracker_finish(int cmd, bool expired) {
+    cmd_entry_t* entry = &commands[cmd];
+    if (!entry->complete) return NULL;
+    for (uint8_t i = 0; i < CMD_TRACKER_MAX_TARGETS; i++) {
+        if (targets[i].in_use && targets[i].cmd == cmd &&
+            targets[i].status == CMD_STATUS_PENDING) {
+            if (!expired) return NULL;
+            targets[i].status = CMD_STATUS_TIMEOUT;
+        }
+    }
+
+    cJSON* result = cJSON_CreateObject();
+    cJSON_AddStringToObject(result, "action", "command_result");
+    cJSON_AddStringToObject(result, "deviceID", get_mac_addr_str());
+    if (entry->id[0]) cJSON_AddStringToObject(result, "id", entry->id);
+    cJSON* results = cJSON_AddArrayToObject(result, "results");
+    int    applied = 0;
+    int    failed  = entry->invalid + entry->untracked;
+    for (uint8_t i = 0; i < CMD_TRACKER_MAX_TARGETS; i++) {
+        cmd_target_t* target = &targets[i];
+        if (!target->in_use || target->cmd != cmd) continue;
+        char   device_id[13];
+        cJSON* item = cJSON_CreateObject();
+        sprintf(device_id, "%02X%02X%02X%02X%02X%02X",
+                MAC2STR(target->addr.addr));
+        cJSON_AddStringToObject(item, "deviceID", device_id);
+        cJSON_AddStringToObject(item, "status",
+                                cmd_status_names[target->status]);
+        cJSON_AddItemToArray(results, item);
+        if (target->status == CMD_STATUS_APPLIED ||
+            target->status == CMD_STATUS_DUPLICATE) {
+            applied++;
+        } else {
+            failed++;
+        }
+        target->in_use = false;
+    }
+    cJSON_AddNumberToObject(result, "applied", applied);
+    cJSON_AddNumberToObject(result, "failed", failed);
+    if (entry->untracked)
+        cJSON_AddNumberToObject(result, "untracked", entry->untracked);
+    char* result_str = cJSON_PrintUnformatted(result);
+    cJSON_Delete(result);
+    entry->in_use = false;
+    return result_str;
+}
+
+static void cmd_tracker_publish(char* result_str) {
+    if (result_str == NULL) return;
+    mqtt_root_publish(result_str, TRAFFIC_CLASS_COMMAND);
+    free(result_str);
+}
+
+static void cmd_tracker_task(void* arg) {
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(CMD_TRACKER_TIMEOUT_MS / 5));
+        int64_t now = esp_timer_get_time();
+        for (uint8_t cmd = 0; cmd < CMD_TRACKER_MAX_COMMANDS; cmd++) {
+            char* result_str = NULL;
+            xSemaphoreTake(tracker_lock, portMAX_DELAY);
+            if (commands[cmd].in_use && commands[cmd].complete &&
+                now >= commands[cmd].deadline_us)
+                result_str = cmd_tracker_finish(cmd, true);
+            xSemaphoreGive(tracker_lock);
+            cmd_tracker_publish(result_str);
+        }
+    }
+}
+
+void cmd_tracker_init(void) {
+    tracker_lock = xSemaphoreCreateMutex();
+    xTaskCreate(cmd_tracker_task, "cmd_tracker", 3072, NULL, 3, NULL);
+}
+
+/* The id as a string. Numbers are printed from valuedouble, valueint is
+ * clamped to INT_MAX and would make large ids (timestamps) all equal */
+static void cmd_tracker_id_str(cJSON* id, char* id_str, size_t len) {
+    id_str[0] = '\0';
+    if (cJSON_IsString(id)) {
+        strncpy(id_str, id->valuestring, len - 1);
+        id_str[len - 1] = '\0';
+    } else if (cJSON_IsNumber(id)) {
+        snprintf(id_str, len, "%.17g", id->valuedouble);
+    }
+}
+
+/* FNV-1a of the whole id, a string id is not cut to CMD_TRACKER_ID_LEN so
+ * ids sharing a long prefix stay apart */
+uint32_t cmd_tracker_seq(cJSON* id) {
+    char        number[32];
+    const char* data = number;
+    if (cJSON_IsString(id)) {
+        data = id->valuestring;
+    } else {
+        cmd_tracker_id_str(id, number, sizeof(number));
+    }
+    if (!data[0]) return 0;
+
+    uint32_t hash = 2166136261u;
+    while (*data) {
+        hash ^= (uint8_t)*data++;
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+int cmd_tracker_begin(cJSON* id) {
+    int cmd = -1;
+    xSemaphoreTake(tracker_lock, portMAX_DELAY);
+    for (uint8_t i = 0; i < CMD_TRACKER_MAX_COMMANDS; i++) {
+        if (commands[i].in_use) continue;
+        cmd_entry_t* entry = &commands[i];
+        memset(entry, 0, sizeof(*entry));
+        entry->in_use = true;
+        cmd_tracker_id_str(id, entry->id, sizeof(entry->id));
+        cmd = i;
+        break;
+    }
+    xSemaphoreGive(tracker_lock);
+    if (cmd < 0) ESP_LOGW(TAG, "Too many commands in flight, not tracked");
+    return cmd;
+}
+
+static void cmd_tracker_add_target(int                cmd,
+                                   const mesh_addr_t* node_addr,
+                                   uint32_t           seq,
+                                   cmd_status_t       status) {
+    if (cmd < 0) return;
+    xSemaphoreTake(tracker_lock, portMAX_DELAY);
+    uint8_t i = 0;
+    while (i < CMD_TRACKER_MAX_TARGETS && targets[i].in_use) i++;
+    if (i < CMD_TRACKER_MAX_TARGETS) {
+        targets[i].in_use = true;
+        targets[i].cmd    = cmd;
+        targets[i].addr   = *node_addr;
+        targets[i].seq    = seq;
+        targets[i].status = status;
+    } else {
+        /* Counted as failed, a retry of the id is deduplicated by seq */
+        ESP_LOGW(TAG, "Too many targets, " MACSTR " is not tracked",
+                 MAC2STR(node_addr->addr));
+        commands[cmd].untracked++;
+    }
+    xSemaphoreGive(tracker_lock);
+}
+
+void cmd_tracker_add(int                cmd,
+                     const mesh_addr_t* node_addr,
+                     uint32_t           seq,
+                     esp_err_t          err) {
+    cmd_tracker_add_target(
+        cmd, node_addr, seq,
+        err == ESP_OK ? CMD_STATUS_PENDING : CMD_STATUS_FAILED);
+}
+
+void cmd_tracker_add_invalid(int cmd) {
+    if (cmd < 0) return;
+    xSemaphoreTake(tracker_lock, portMAX_DELAY);
+    commands[cmd].invalid++;
+    xSemaphoreGive(tracker_lock);
+}
+
+void cmd_tracker_add_local(int cmd, const char* device_id) {
+    mesh_addr_t  addr;
+    unsigned int bytearray[6];
+    for (int i = 0; i < 6; i++) {
+        sscanf(device_id + 2 * i, "%02X", &bytearray[i]);
+        addr.addr[i] = bytearray[i];
+    }
+    cmd_tracker_add_target(cmd, &addr, 0, CMD_STATUS_APPLIED);
+}
+
+void cmd_tracker_end(int cmd) {
+    if (cmd < 0) return;
+    xSemaphoreTake(tracker_lock, portMAX_DELAY);
+    commands[cmd].complete = true;
+    commands[cmd].deadline_us =
+        esp_timer_get_time() + CMD_TRACKER_TIMEOUT_MS * 1000LL;
+    char* result_str = cmd_tracker_finish(cmd, false);
+    xSemaphoreGive(tracker_lock);
+    cmd_tracker_publish(result_str);
+}
+
+void cmd_tracker_ack(const mesh_addr_t* node_addr, const char* msg) {
+    cJSON* data   = cJSON_Parse(msg);
+    cJSON* seq    = cJSON_GetObjectItem(data, "seq");
+    cJSON* status = cJSON_GetObjectItem(data, "status");
+    if (!cJSON_IsNumber(seq)) {
+        cJSON_Delete(data);
+        return;
+    }
+    cmd_status_t new_status = CMD_STATUS_APPLIED;
+    if (cJSON_IsString(status) &&
+        strcmp(status->valuestring, "duplicate") == 0)
+        new_status = CMD_STATUS_DUPLICATE;
+    uint32_t ack_seq = (uint32_t)seq->valuedouble;
+    cJSON_Delete(data);
+
+    /* A coalesced frame acknowledges every command merged into it */
+    for (uint8_t cmd = 0; cmd < CMD_TRACKER_MAX_COMMANDS; cmd++) {
+        char* result_str = NULL;
+        bool  matched    = false;
+        xSemaphoreTake(tracker_lock, portMAX_DELAY);
+        for (uint8_t i = 0; i < CMD_TRACKER_MAX_TARGETS; i++) {
+            cmd_target_t* target = &targets[i];
+            if (target->in_use && target->cmd == cmd &&
+                target->seq == ack_seq &&
+                target->status == CMD_STATUS_PENDING &&
+                memcmp(target->addr.addr, node_addr->addr, 6) == 0) {
+                target->status = new_status;
+                matched        = true;
+            }
+        }
+        if (matched) result_str = cmd_tracker_finish(cmd, false);
+        xSemaphoreGive(tracker_lock);
+        cmd_tracker_publish(result_str);
+    }
+}
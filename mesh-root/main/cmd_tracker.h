@@ -0,0 +1,44 @@
+#pragma once
+#include <cJSON.h>
+
+#include "esp_mesh.h"
+
+#define CMD_TRACKER_MAX_COMMANDS 8  /* Commands waiting for their acks */
+#define CMD_TRACKER_MAX_TARGETS  64 /* Devices over all those commands */
+#define CMD_TRACKER_ID_LEN       40
+#define CMD_TRACKER_TIMEOUT_MS   5000
+
+/* Nodes answer a command frame with {"action":"ack","seq":n,"status":..} */
+#define CMD_TRACKER_ACK_PREFIX   "{\"action\":\"ack\""
+
+/* Start the timeout task */
+void cmd_tracker_init(void);
+
+/* Start tracking a command with its optional cloud "id", -1 if the
+ * tracker is full (the command is still executed, but not reported) */
+int  cmd_tracker_begin(cJSON* id);
+
+/* Sequence number for the command frames of a cloud "id". A retry of the
+ * same id reuses it, so nodes that already applied it answer "duplicate".
+ * 0 without an id, the send queue then assigns one */
+uint32_t cmd_tracker_seq(cJSON* id);
+
+/* A command frame with seq was queued to a node, err if it was not. With
+ * the target table full it is reported as failed in "untracked" */
+void cmd_tracker_add(int                cmd,
+                     const mesh_addr_t* node_addr,
+                     uint32_t           seq,
+                     esp_err_t          err);
+
+/* An entry of the command had no valid deviceID, counted as failed */
+void cmd_tracker_add_invalid(int cmd);
+
+/* Channels of the root itself were applied */
+void cmd_tracker_add_local(int cmd, const char* device_id);
+
+/* Every target was added, the result is published once all acks are in
+ * or CMD_TRACKER_TIMEOUT_MS has elapsed */
+void cmd_tracker_end(int cmd);
+
+/* Handle an ack received from a node */
+void cmd_tracker_ack(const mesh_addr_t* node_addr, const char* msg);
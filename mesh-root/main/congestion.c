@@ -0,0 +1,77 @@
+#include "congestion.h"
+
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mesh_root.h"
+#include "publish_queue.h"
+
+static const char*        TAG            = "congestion";
+static bool               mqtt_up        = true; /* Until a disconnect */
+static bool               tods_reachable = true;
+static congestion_level_t level          = CONGESTION_NONE;
+static TaskHandle_t       congestion_task_handle;
+
+static congestion_level_t congestion_measure(void) {
+    if (!mqtt_up || !tods_reachable) return CONGESTION_SEVERE;
+    uint8_t fill = publish_queue_fill();
+    if (fill >= CONGESTION_SEVERE_PCT) return CONGESTION_SEVERE;
+    if (fill >= CONGESTION_MODERATE_PCT) return CONGESTION_MODERATE;
+    return CONGESTION_NONE;
+}
+
+static void congestion_broadcast(void) {
+    char data[40];
+    sprintf(data, "{\"action\":\"congestion\",\"level\":%d}", level);
+    send_to_all(data);
+}
+
+/* Raise at once, lower only once the new level held CONGESTION_CLEAR_MS */
+static void congestion_task(void* arg) {
+    int64_t lower_since = 0;
+    int64_t last_sent   = 0;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONGESTION_CHECK_MS));
+        int64_t            now      = esp_timer_get_time();
+        congestion_level_t measured = congestion_measure();
+        bool               changed  = false;
+        if (measured > level) {
+            level   = measured;
+            changed = true;
+        } else if (measured < level) {
+            if (lower_since == 0) lower_since = now;
+            if (now - lower_since >= CONGESTION_CLEAR_MS * 1000LL) {
+                level   = measured;
+                changed = true;
+            }
+        }
+        if (measured >= level) lower_since = 0;
+
+        if (changed) ESP_LOGW(TAG, "Congestion level %d", level);
+        if (changed || (level != CONGESTION_NONE &&
+                        now - last_sent >= CONGESTION_REFRESH_MS * 1000LL)) {
+            congestion_broadcast();
+            last_sent = now;
+        }
+    }
+}
+
+void congestion_init(void) {
+    xTaskCreate(congestion_task, "congestion", 2048, NULL, 4,
+                &congestion_task_handle);
+}
+
+void congestion_set_mqtt(bool connected) {
+    mqtt_up = connected;
+    if (congestion_task_handle) xTaskNotifyGive(congestion_task_handle);
+}
+
+void congestion_set_tods(bool reachable) {
+    tods_reachable = reachable;
+    if (congestion_task_handle) xTaskNotifyGive(congestion_task_handle);
+}
+
+congestion_level_t congestion_get_level(void) { return level; }
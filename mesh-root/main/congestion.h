@@ -0,0 +1,25 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CONGESTION_CHECK_MS     500
+#define CONGESTION_CLEAR_MS     5000  /* A level must hold this long to drop */
+#define CONGESTION_REFRESH_MS   30000 /* Repeated for nodes that join late */
+#define CONGESTION_MODERATE_PCT 50    /* Publish queue fill levels */
+#define CONGESTION_SEVERE_PCT   80
+
+typedef enum {
+    CONGESTION_NONE,
+    CONGESTION_MODERATE, /* Nodes stretch telemetry */
+    CONGESTION_SEVERE,   /* Uplink down or queue nearly full */
+} congestion_level_t;
+
+/* Start watching the uplink, changes are broadcast to every node as
+ * {"action":"congestion","level":n} */
+void               congestion_init(void);
+
+/* MQTT connection and toDS reachability of the root */
+void               congestion_set_mqtt(bool connected);
+void               congestion_set_tods(bool reachable);
+
+congestion_level_t congestion_get_level(void);
@@ -0,0 +1,245 @@
+#include "device_shadow.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/* Channels are kept rendered so a snapshot is a plain concatenation.
+ * version counts the changes, acked_version is the last one the broker
+ * acknowledged and pending_msg_id the publish that carries pending_version */
+typedef struct {
+    char     device_id[13];
+    char*    channels;
+    size_t   channels_len;
+    int64_t  updated_us;
+    uint32_t version;
+    uint32_t acked_version;
+    uint32_t pending_version;
+    int      pending_msg_id;
+} device_shadow_t;
+
+static const char*       TAG = "shadow";
+static device_shadow_t   shadow_list[DEVICE_SHADOW_MAX_NODES];
+static size_t            shadow_channels_len = 0;
+static uint8_t           shadow_count        = 0;
+static SemaphoreHandle_t shadow_lock;
+
+/* Acknowledgements that matched no pending state while a state publish
+ * was in flight. The broker may answer before the publish task has
+ * registered the msg_id, set_pending looks here first and then forgets
+ * the others, they belonged to other publishes. Both sides run under
+ * shadow_lock */
+static int               early_acks[DEVICE_SHADOW_EARLY_ACKS];
+static uint8_t           early_ack_next   = 0;
+static bool              state_publishing = false;
+
+void                     device_shadow_init(void) {
+    shadow_lock = xSemaphoreCreateMutex();
+}
+
+static device_shadow_t* device_shadow_find(const char* device_id,
+                                           bool        create) {
+    device_shadow_t* free_slot = NULL;
+    for (uint8_t i = 0; i < DEVICE_SHADOW_MAX_NODES; i++) {
+        if (shadow_list[i].device_id[0] == '\0') {
+            if (free_slot == NULL) free_slot = &shadow_list[i];
+        } else if (strcmp(shadow_list[i].device_id, device_id) == 0) {
+            return &shadow_list[i];
+        }
+    }
+    if (!create) return NULL;
+    if (free_slot == NULL) {
+        ESP_LOGW(TAG, "Shadow table full, %s is not cached", device_id);
+        return NULL;
+    }
+    strncpy(free_slot->device_id, device_id, sizeof(free_slot->device_id) - 1);
+    return free_slot;
+}
+
+bool device_shadow_update(const char* device_id, const char* payload) {
+    cJSON* frame    = cJSON_Parse(payload);
+    cJSON* channels = cJSON_GetObjectItem(frame, "channels");
+    char*  copy     = cJSON_IsObject(channels)
+                          ? cJSON_PrintUnformatted(channels)
+                          : strdup("{}");
+    bool   changed  = false;
+    cJSON_Delete(frame);
+    if (copy == NULL) return false;
+
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    device_shadow_t* shadow = device_shadow_find(device_id, true);
+    if (shadow != NULL) {
+        shadow->updated_us = esp_timer_get_time();
+        changed = shadow->channels == NULL || strcmp(shadow->channels, copy);
+    }
+    if (changed) {
+        if (shadow->channels == NULL) shadow_count++;
+        shadow_channels_len -= shadow->channels_len;
+        free(shadow->channels);
+        shadow->channels     = copy;
+        shadow->channels_len = strlen(copy);
+        shadow_channels_len += shadow->channels_len;
+        shadow->version++;
+        copy = NULL;
+    }
+    xSemaphoreGive(shadow_lock);
+    free(copy);
+    return changed;
+}
+
+char* device_shadow_print(const char* device_id, uint32_t* version) {
+    char* out = NULL;
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    device_shadow_t* shadow = device_shadow_find(device_id, false);
+    if (shadow != NULL && shadow->channels != NULL) {
+        out = malloc(shadow->channels_len + 64);
+        if (out != NULL) {
+            sprintf(out,
+                    "{\"deviceID\":\"%s\",\"version\":%u,\"channels\":%s}",
+                    shadow->device_id, (unsigned)shadow->version,
+                    shadow->channels);
+            *version = shadow->version;
+        }
+    }
+    xSemaphoreGive(shadow_lock);
+    return out;
+}
+
+void device_shadow_publishing(void) {
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    state_publishing = true;
+    xSemaphoreGive(shadow_lock);
+}
+
+void device_shadow_set_pending(const char* device_id,
+                               uint32_t    version,
+                               int         msg_id) {
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    device_shadow_t* shadow = device_shadow_find(device_id, false);
+    bool             acked  = false;
+    for (uint8_t i = 0; i < DEVICE_SHADOW_EARLY_ACKS; i++) {
+        if (msg_id > 0 && early_acks[i] == msg_id) acked = true;
+        early_acks[i] = 0;
+    }
+    state_publishing = false;
+    /* A failed publish leaves the version unacknowledged */
+    if (msg_id <= 0) shadow = NULL;
+    if (shadow != NULL && acked) {
+        shadow->acked_version   = version;
+        shadow->pending_version = 0;
+    } else if (shadow != NULL) {
+        shadow->pending_version = version;
+        shadow->pending_msg_id  = msg_id;
+    }
+    xSemaphoreGive(shadow_lock);
+}
+
+void device_shadow_acked(int msg_id) {
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    for (uint8_t i = 0; i < DEVICE_SHADOW_MAX_NODES; i++) {
+        device_shadow_t* shadow = &shadow_list[i];
+        if (shadow->channels != NULL && shadow->pending_msg_id == msg_id &&
+            shadow->pending_version) {
+            shadow->acked_version   = shadow->pending_version;
+            shadow->pending_version = 0;
+            xSemaphoreGive(shadow_lock);
+            return;
+        }
+    }
+    if (state_publishing) {
+        early_acks[early_ack_next] = msg_id;
+        early_ack_next = (early_ack_next + 1) % DEVICE_SHADOW_EARLY_ACKS;
+    }
+    xSemaphoreGive(shadow_lock);
+}
+
+int device_shadow_next_unacked(int index, char* device_id) {
+    int found = -1;
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    for (; index < DEVICE_SHADOW_MAX_NODES; index++) {
+        device_shadow_t* shadow = &shadow_list[index];
+        if (shadow->channels != NULL &&
+            shadow->version != shadow->acked_version) {
+            strcpy(device_id, shadow->device_id);
+            found = index;
+            break;
+        }
+    }
+    xSemaphoreGive(shadow_lock);
+    return found;
+}
+
+/* Caller holds shadow_lock */
+static void device_shadow_to_json(device_shadow_t* shadow, cJSON* array) {
+    cJSON* item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "deviceID", shadow->device_id);
+    cJSON* channels = cJSON_Parse(shadow->channels);
+    cJSON_AddItemToObject(item, "channels",
+                          channels ? channels : cJSON_CreateObject());
+    cJSON_AddNumberToObject(
+        item, "age_ms", (esp_timer_get_time() - shadow->updated_us) / 1000);
+    cJSON_AddItemToArray(array, item);
+}
+
+bool device_shadow_add_to_json(const char* device_id, cJSON* array) {
+    bool found = false;
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    device_shadow_t* shadow = device_shadow_find(device_id, false);
+    if (shadow != NULL && shadow->channels != NULL) {
+        device_shadow_to_json(shadow, array);
+        found = true;
+    }
+    xSemaphoreGive(shadow_lock);
+    return found;
+}
+
+void device_shadow_add_all_to_json(cJSON* array) {
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    for (uint8_t i = 0; i < DEVICE_SHADOW_MAX_NODES; i++) {
+        if (shadow_list[i].channels != NULL) {
+            device_shadow_to_json(&shadow_list[i], array);
+        }
+    }
+    xSemaphoreGive(shadow_lock);
+}
+
+#define SHADOW_ITEM_FMT "{\"deviceID\":\"%s\",\"age_ms\":%lld,\"channels\":"
+/* Item overhead without channels: format, 12 digit ID, 20 digit age, '},' */
+#define SHADOW_ITEM_OVERHEAD (sizeof(SHADOW_ITEM_FMT) + 12 + 20 + 2)
+
+char* device_shadow_print_all(const char* prefix,
+                              const char* suffix,
+                              size_t*     len) {
+    xSemaphoreTake(shadow_lock, portMAX_DELAY);
+    /* '[', ']' and the terminator */
+    size_t size = strlen(prefix) + shadow_channels_len +
+                  shadow_count * SHADOW_ITEM_OVERHEAD + strlen(suffix) + 3;
+    char*  out  = malloc(size);
+    if (out == NULL) {
+        xSemaphoreGive(shadow_lock);
+        return NULL;
+    }
+
+    int64_t now = esp_timer_get_time();
+    char*   pos = out + sprintf(out, "%s[", prefix);
+    for (uint8_t i = 0; i < DEVICE_SHADOW_MAX_NODES; i++) {
+        device_shadow_t* shadow = &shadow_list[i];
+        if (shadow->channels == NULL) continue;
+        if (pos[-1] == '}') *pos++ = ',';
+        pos += sprintf(pos, SHADOW_ITEM_FMT, shadow->device_id,
+                       (long long)((now - shadow->updated_us) / 1000));
+        memcpy(pos, shadow->channels, shadow->channels_len);
+        pos += shadow->channels_len;
+        *pos++ = '}';
+    }
+    xSemaphoreGive(shadow_lock);
+
+    *pos++ = ']';
+    pos    = stpcpy(pos, suffix);
+    *len   = pos - out;
+    return out;
+}
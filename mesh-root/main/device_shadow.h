@@ -0,0 +1,50 @@
+#pragma once
+#include <cJSON.h>
+
+#include "esp_mesh.h"
+
+#define DEVICE_SHADOW_MAX_NODES  64
+#define DEVICE_SHADOW_EARLY_ACKS 8 /* Acks kept during one state publish */
+
+/* Create the last-known state cache of every node */
+void  device_shadow_init(void);
+
+/* Store the latest telemetry frame of a device, true if its channels
+ * changed */
+bool  device_shadow_update(const char* device_id, const char* payload);
+
+/* {"deviceID","version","channels"} of a device, NULL if unknown. The
+ * caller frees the result */
+char* device_shadow_print(const char* device_id, uint32_t* version);
+
+/* A state publish is about to be handed to MQTT, unmatched acks are kept
+ * from now on until its set_pending */
+void  device_shadow_publishing(void);
+
+/* A state publish of a version was handed to MQTT as msg_id, or failed
+ * with msg_id <= 0. The ack may already have arrived, it is then applied
+ * at once */
+void  device_shadow_set_pending(const char* device_id,
+                                uint32_t    version,
+                                int         msg_id);
+
+/* The broker acknowledged msg_id */
+void  device_shadow_acked(int msg_id);
+
+/* First device from index whose last version was not acknowledged, its
+ * index or -1. device_id receives 13 bytes */
+int   device_shadow_next_unacked(int index, char* device_id);
+
+/* Add {"deviceID","channels","age_ms"} of a device to a JSON array,
+ * false if the device has not reported yet */
+bool  device_shadow_add_to_json(const char* device_id, cJSON* array);
+
+/* Add every cached device to a JSON array */
+void  device_shadow_add_all_to_json(cJSON* array);
+
+/* Render every cached device as "<prefix>[{...},...]<suffix>" from the
+ * stored channel strings, no JSON tree is built. *len is the length without
+ * the terminator, the caller frees the buffer */
+char* device_shadow_print_all(const char* prefix,
+                              const char* suffix,
+                              size_t*     len);
@@ -1,7 +1,11 @@
 #include <cJSON.h>
 #include <stdio.h>
 
+#include "broker_select.h"
+#include "cmd_tracker.h"
+#include "congestion.h"
 #include "device.h"
+#include "device_shadow.h"
 #include "driver/gpio.h"
 #include "esp_mesh.h"
 #include "freertos/FreeRTOS.h"
@@ -9,8 +13,19 @@
 #include "freertos/queue.h"
 #include "freertos/task.h"
 #include "led_indicator.h"
+#include "mesh_frag.h"
 #include "mesh_root.h"
+#include "msg_buf.h"
+#include "node_group.h"
+#include "prov_ledger.h"
+#include "publish_queue.h"
+#include "rate_limit.h"
+#include "rtt_probe.h"
 #include "sdkconfig.h"
+#include "send_queue.h"
+#include "snapshot.h"
+#include "telemetry_dedup.h"
+#include "topology.h"
 
 #define MAX_DEVICES  6
 #define RELAY_1      16
@@ -241,8 +256,13 @@ void turn_all_on() {
 }
 
 void turn_all_off() {
+    char temp[10];
     for (uint8_t i = 0; i < MAX_DEVICES; i++) {
-        if (device_list[i].device_state) turn_off(device_list[i].relay_io);
+        if (device_list[i].device_state == 1) {
+            turn_off(device_list[i].relay_io);
+            sprintf(temp, "relay_%d", i + 1);
+            device_set_channel_value(temp, &(device_list[i].device_state));
+        }
     }
 }
 
@@ -260,50 +280,218 @@ void create_device_channel() {
     }
 }
 
+static void send_provision_ack(mesh_addr_t node_addr) {
+    char data[] = "{\"action\":\"provision\"}";
+    send_to_node(node_addr, data, TRAFFIC_CLASS_PROVISION);
+    printf("Send to node\n");
+    printf("%s\n", data);
+}
+
+static void device_id_to_mesh_addr(char* device_id_str, mesh_addr_t* addr) {
+    unsigned int bytearray[6];
+    for (int i = 0; i < 6; i++) {
+        sscanf(device_id_str + 2 * i, "%02X", &bytearray[i]);
+        addr->addr[i] = bytearray[i];
+    }
+}
+
+/* {"action":"topology","parent":"<ID>","layer":n} sent by a node */
+static void topology_report_handler(const mesh_addr_t* src, const char* msg) {
+    cJSON* data   = cJSON_Parse(msg);
+    cJSON* parent = cJSON_GetObjectItem(data, "parent");
+    cJSON* layer  = cJSON_GetObjectItem(data, "layer");
+    if (cJSON_IsString(parent) && strlen(parent->valuestring) == 12 &&
+        cJSON_IsNumber(layer)) {
+        mesh_addr_t parent_addr;
+        device_id_to_mesh_addr(parent->valuestring, &parent_addr);
+        topology_node_report(src, &parent_addr, layer->valueint);
+    }
+    cJSON_Delete(data);
+}
+
+/* Classify a node message by its leading "action" field */
+static traffic_class_t traffic_class_from_data(const char* data) {
+    static const char prefix[] = "{\"action\":\"";
+    if (strncmp(data, prefix, sizeof(prefix) - 1) != 0)
+        return TRAFFIC_CLASS_COMMAND;
+
+    const char* action = data + sizeof(prefix) - 1;
+    if (strncmp(action, "telemetry\"", 10) == 0) return TRAFFIC_CLASS_TELEMETRY;
+    if (strncmp(action, "provision\"", 10) == 0) return TRAFFIC_CLASS_PROVISION;
+    if (strncmp(action, "log\"", 4) == 0) return TRAFFIC_CLASS_LOG;
+    return TRAFFIC_CLASS_COMMAND;
+}
+
+/* Dispatch one whole message from a node, the caller keeps its reference */
+static void mesh_root_handle(mesh_addr_t* src, msg_buf_t* buf) {
+    char* msg = buf->data;
+    if (strncmp(msg, TOPOLOGY_REPORT_PREFIX,
+                sizeof(TOPOLOGY_REPORT_PREFIX) - 1) == 0) {
+        topology_report_handler(src, msg);
+        return;
+    }
+    if (strncmp(msg, CMD_TRACKER_ACK_PREFIX,
+                sizeof(CMD_TRACKER_ACK_PREFIX) - 1) == 0) {
+        cmd_tracker_ack(src, msg);
+        return;
+    }
+    if (strncmp(msg, RTT_PROBE_PONG_PREFIX,
+                sizeof(RTT_PROBE_PONG_PREFIX) - 1) == 0) {
+        rtt_probe_pong(src, msg);
+        return;
+    }
+    traffic_class_t traffic_class = traffic_class_from_data(msg);
+    /* Every reassembled message costs a token, a flooding node is cut off
+     * before the shadow and the publisher. Control traffic above and
+     * provisioning are never limited */
+    if (traffic_class != TRAFFIC_CLASS_PROVISION && !rate_limit_allow(src))
+        return;
+    if (traffic_class == TRAFFIC_CLASS_TELEMETRY) {
+        char device_id[13];
+        sprintf(device_id, "%02X%02X%02X%02X%02X%02X", MAC2STR(src->addr));
+        if (device_shadow_update(device_id, msg)) {
+            mqtt_root_publish_state(device_id);
+        }
+        /* The shadow stays fresh, the broker only sees changes */
+        if (!telemetry_dedup_check(src, msg)) return;
+    } else if (traffic_class == TRAFFIC_CLASS_PROVISION) {
+        /* Known node and schema: acknowledge without the cloud */
+        uint32_t hash = prov_ledger_hash(msg);
+        if (prov_ledger_contains(src, hash)) {
+            send_provision_ack(*src);
+            return;
+        }
+        prov_ledger_set_pending(src, hash);
+    }
+    mqtt_root_publish_buf(src, buf, traffic_class);
+}
+
+/* Frames are received straight into pooled buffers. A whole frame is
+ * passed on in place, the publish queue only takes a reference */
 static void mesh_root_receive(void* arg) {
     mesh_addr_t src;
     mesh_data_t recv_data;
     esp_err_t   err;
-    int         flag       = 0;
-    uint8_t     data[1024] = {0};
-    recv_data.data         = data;
+    int         flag = 0;
+    msg_buf_t*  rx   = NULL;
+    msg_buf_t*  buf;
+    char*       msg;
+    bool        allocated;
     for (;;) {
-        memset(recv_data.data, 0x00, 1024);
-        recv_data.size = 1024;
+        if (rx == NULL && (rx = msg_buf_alloc()) == NULL) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+        recv_data.data = (uint8_t*)rx->data;
+        recv_data.size = MESH_MPS;
         err = esp_mesh_recv(&src, &recv_data, portMAX_DELAY, &flag, NULL, 0);
-        if (err == ESP_OK && recv_data.size) {
-            mqtt_root_publish((char*)(recv_data.data));
+        if (err != ESP_OK) continue;
+        msg = mesh_frag_receive(&src, &recv_data, &allocated);
+        if (msg == NULL) continue;
+        if (allocated) {
+            /* Reassembled on the heap, the receive buffer is reused */
+            buf = msg_buf_wrap(msg);
+            if (buf == NULL) continue;
+        } else {
+            buf = rx;
+            rx  = NULL;
+            msg_buf_set_len(buf, recv_data.size);
         }
+        mesh_root_handle(&src, buf);
+        msg_buf_unref(buf);
     }
 }
 
-static void command_action_handler(char* device_id_str, cJSON* channel_data) {
-    if (strcmp(device_id_str, get_mac_addr_str()) == 0) {
-        char   relay_temp[10];
-        cJSON* relay_state = NULL;
-        for (uint8_t i = 0; i < MAX_DEVICES; i++) {
-            sprintf(relay_temp, "relay_%d", i + 1);
-            relay_state = cJSON_GetObjectItem(channel_data, relay_temp);
-            if (cJSON_IsBool(relay_state)) {
-                if (relay_state->valueint) {
-                    turn_on(device_list[i].relay_io);
-                } else {
-                    turn_off(device_list[i].relay_io);
-                }
-                device_set_channel_value(relay_temp,
-                                         &(device_list[i].device_state));
+static void apply_channels(cJSON* channel_data) {
+    char   relay_temp[10];
+    cJSON* relay_state = NULL;
+    for (uint8_t i = 0; i < MAX_DEVICES; i++) {
+        sprintf(relay_temp, "relay_%d", i + 1);
+        relay_state = cJSON_GetObjectItem(channel_data, relay_temp);
+        if (cJSON_IsBool(relay_state)) {
+            if (relay_state->valueint) {
+                turn_on(device_list[i].relay_io);
+            } else {
+                turn_off(device_list[i].relay_io);
             }
+            device_set_channel_value(relay_temp,
+                                     &(device_list[i].device_state));
         }
-        root_telemetry();
+    }
+    root_telemetry();
+}
+
+/* cmd is the tracker entry the outcome is reported to, -1 for none. seq
+ * comes from cmd_tracker_seq, 0 lets the send queue assign one */
+static esp_err_t command_action_handler(char*    device_id_str,
+                                        cJSON*   channel_data,
+                                        int      cmd,
+                                        uint32_t seq) {
+    esp_err_t   err = ESP_OK;
+    mesh_addr_t mesh_child_addr;
+    device_id_to_mesh_addr(device_id_str, &mesh_child_addr);
+    if (!cJSON_IsObject(channel_data)) {
+        err = ESP_ERR_INVALID_ARG;
+        cmd_tracker_add(cmd, &mesh_child_addr, 0, err);
+    } else if (strcmp(device_id_str, get_mac_addr_str()) == 0) {
+        apply_channels(channel_data);
+        cmd_tracker_add_local(cmd, device_id_str);
     } else {
-        mesh_addr_t  mesh_child_addr;
-        unsigned int bytearray[6];
-        for (int i = 0; i < 6; i++) {
-            sscanf(device_id_str + 2 * i, "%02X", &bytearray[i]);
-            mesh_child_addr.addr[i] = bytearray[i];
+        err = send_channels_to_node(mesh_child_addr, channel_data, &seq);
+        cmd_tracker_add(cmd, &mesh_child_addr, seq, err);
+    }
+    return err;
+}
+
+/* {"action":"command","id":..,"commands":[{"deviceID":..,"channels":{..}}]}
+ * One MQTT message for many devices, answered by the single command_result
+ * of the tracker */
+static void batch_command_handler(cJSON* data_json, cJSON* commands) {
+    cJSON*   id      = cJSON_GetObjectItem(data_json, "id");
+    cJSON*   command = NULL;
+    uint32_t seq     = cmd_tracker_seq(id);
+
+    /* Without a tracker entry nothing would answer, refuse the batch so
+     * the cloud retries it, the retry keeps its sequence number */
+    int cmd = cmd_tracker_begin(id);
+    if (cmd < 0) {
+        cJSON* result = cJSON_CreateObject();
+        cJSON_AddStringToObject(result, "action", "command_result");
+        cJSON_AddStringToObject(result, "deviceID", get_mac_addr_str());
+        if (id != NULL)
+            cJSON_AddItemToObject(result, "id", cJSON_Duplicate(id, 1));
+        cJSON_AddStringToObject(result, "status", "busy");
+        char* result_str = cJSON_PrintUnformatted(result);
+        mqtt_root_publish(result_str, TRAFFIC_CLASS_COMMAND);
+        free(result_str);
+        cJSON_Delete(result);
+        return;
+    }
+
+    /* Local channels are applied last so the root telemetry goes out once */
+    cJSON* local_channels = NULL;
+    cJSON_ArrayForEach(command, commands) {
+        cJSON* device_id_object = cJSON_GetObjectItem(command, "deviceID");
+        cJSON* channel_data     = cJSON_GetObjectItem(command, "channels");
+        if (!cJSON_IsString(device_id_object) ||
+            strlen(device_id_object->valuestring) != 12) {
+            cmd_tracker_add_invalid(cmd);
+            continue;
+        }
+
+        char* device_id_str = device_id_object->valuestring;
+        if (strcmp(device_id_str, get_mac_addr_str()) == 0 &&
+            cJSON_IsObject(channel_data)) {
+            local_channels = channel_data;
+        } else {
+            command_action_handler(device_id_str, channel_data, cmd, seq);
         }
-        send_to_node(mesh_child_addr, cJSON_PrintUnformatted(channel_data));
     }
+    if (local_channels != NULL) {
+        apply_channels(local_channels);
+        cmd_tracker_add_local(cmd, get_mac_addr_str());
+    }
+    cmd_tracker_end(cmd);
 }
 
 static void provision_action_handler(char* device_id_str) {
@@ -312,40 +500,324 @@ static void provision_action_handler(char* device_id_str) {
         ESP_ERROR_CHECK(nvs_commit(nvs_handler));
         root_set_is_provisioned(true);
     } else {
-        mesh_addr_t  mesh_child_addr;
-        unsigned int bytearray[6];
-        for (int i = 0; i < 6; i++) {
-            sscanf(device_id_str + 2 * i, "%02X", &bytearray[i]);
-            mesh_child_addr.addr[i] = bytearray[i];
+        mesh_addr_t mesh_child_addr;
+        device_id_to_mesh_addr(device_id_str, &mesh_child_addr);
+        prov_ledger_commit(&mesh_child_addr);
+        send_provision_ack(mesh_child_addr);
+    }
+}
+
+static void send_group_membership(mesh_addr_t node_addr,
+                                  mesh_addr_t group_addr, const char* op) {
+    char group_id[13];
+    sprintf(group_id, "%02X%02X%02X%02X%02X%02X", MAC2STR(group_addr.addr));
+    cJSON* data = cJSON_CreateObject();
+    cJSON_AddStringToObject(data, "action", "group");
+    cJSON_AddStringToObject(data, "op", op);
+    cJSON_AddStringToObject(data, "groupID", group_id);
+    char* data_str = cJSON_PrintUnformatted(data);
+    send_to_node(node_addr, data_str, TRAFFIC_CLASS_PROVISION);
+    free(data_str);
+    cJSON_Delete(data);
+}
+
+/* {"action":"group","op":"join"|"leave","group":"<name>","deviceID":"..."} */
+static void group_action_handler(char* device_id_str, cJSON* data_json) {
+    cJSON* op_object    = cJSON_GetObjectItem(data_json, "op");
+    cJSON* group_object = cJSON_GetObjectItem(data_json, "group");
+    if (!cJSON_IsString(op_object) || !cJSON_IsString(group_object)) return;
+
+    char*       group_name = group_object->valuestring;
+    bool        is_root    = strcmp(device_id_str, get_mac_addr_str()) == 0;
+    mesh_addr_t node_addr;
+    device_id_to_mesh_addr(device_id_str, &node_addr);
+
+    /* The root applies group commands locally, nodes join the mesh group ID */
+    if (strcmp(op_object->valuestring, "join") == 0) {
+        if (node_group_add_member(group_name, &node_addr) && !is_root) {
+            send_group_membership(node_addr, node_group_find(group_name)->addr,
+                                  "join");
+        }
+    } else if (strcmp(op_object->valuestring, "leave") == 0) {
+        node_group_t* group = node_group_find(group_name);
+        if (group == NULL) return;
+        mesh_addr_t group_addr = group->addr;
+        if (node_group_remove_member(group_name, &node_addr) && !is_root) {
+            send_group_membership(node_addr, group_addr, "leave");
         }
-        cJSON* data = cJSON_CreateObject();
-        cJSON_AddStringToObject(data, "action", "provision");
-        send_to_node(mesh_child_addr, cJSON_PrintUnformatted(data));
-        printf("Send to node\n");
-        printf("%s\n", cJSON_PrintUnformatted(data));
-        cJSON_Delete(data);
     }
 }
 
-static void mqtt_root_receive(char* topic, char* data) {
-    cJSON* data_json     = cJSON_Parse(data);
+/* down/GROUP/<root>/<name>: one mesh group frame instead of one unicast per
+ * node */
+static void group_command_handler(char* group_name, cJSON* data_json) {
+    cJSON* action_object = cJSON_GetObjectItem(data_json, "action");
+    if (!cJSON_IsString(action_object) ||
+        strcmp(action_object->valuestring, "command") != 0)
+        return;
+
+    node_group_t* group = node_group_find(group_name);
+    if (group == NULL) {
+        printf("Unknown group %s\n", group_name);
+        return;
+    }
+
+    cJSON*      channel_data = cJSON_GetObjectItem(data_json, "channels");
+    mesh_addr_t root_addr;
+    if (!cJSON_IsObject(channel_data)) return;
+    device_id_to_mesh_addr(get_mac_addr_str(), &root_addr);
+    if (node_group_has_member(group, &root_addr)) {
+        apply_channels(channel_data);
+    }
+
+    char* data = cJSON_PrintUnformatted(channel_data);
+    send_to_group(group->addr, data);
+    free(data);
+}
+
+/* {"action":"get","id":..,"deviceID":".."|"deviceIDs":[..]} is answered from
+ * the root state cache, no device is woken up. No ID means every device */
+static void get_action_handler(cJSON* data_json) {
+    cJSON* result     = cJSON_CreateObject();
+    cJSON* id         = cJSON_GetObjectItem(data_json, "id");
+    cJSON* device_id  = cJSON_GetObjectItem(data_json, "deviceID");
+    cJSON* device_ids = cJSON_GetObjectItem(data_json, "deviceIDs");
+    cJSON* unknown    = NULL;
+
+    cJSON_AddStringToObject(result, "action", "get_result");
+    cJSON_AddStringToObject(result, "deviceID", get_mac_addr_str());
+    if (id != NULL) cJSON_AddItemToObject(result, "id", cJSON_Duplicate(id, 1));
+    cJSON* devices = cJSON_AddArrayToObject(result, "devices");
+
+    if (cJSON_IsString(device_id)) {
+        if (!device_shadow_add_to_json(device_id->valuestring, devices)) {
+            unknown = cJSON_AddArrayToObject(result, "unknown");
+            cJSON_AddItemToArray(unknown,
+                                 cJSON_CreateString(device_id->valuestring));
+        }
+    } else if (cJSON_IsArray(device_ids)) {
+        cJSON* item = NULL;
+        cJSON_ArrayForEach(item, device_ids) {
+            if (!cJSON_IsString(item)) continue;
+            if (!device_shadow_add_to_json(item->valuestring, devices)) {
+                if (unknown == NULL)
+                    unknown = cJSON_AddArrayToObject(result, "unknown");
+                cJSON_AddItemToArray(unknown,
+                                     cJSON_CreateString(item->valuestring));
+            }
+        }
+    } else {
+        device_shadow_add_all_to_json(devices);
+    }
+
+    char* result_str = cJSON_PrintUnformatted(result);
+    mqtt_root_publish(result_str, TRAFFIC_CLASS_COMMAND);
+    free(result_str);
+    cJSON_Delete(result);
+}
+
+/* Counters of the root forwarding path */
+static void stats_action_handler(void) {
+    send_queue_stats_t    queue_stats;
+    publish_queue_stats_t publish_stats;
+    mesh_frag_stats_t     frag_stats;
+    msg_buf_stats_t       buf_stats;
+    send_queue_get_stats(&queue_stats);
+    publish_queue_get_stats(&publish_stats);
+    mesh_frag_get_stats(&frag_stats);
+
+    cJSON* result = cJSON_CreateObject();
+    cJSON_AddStringToObject(result, "action", "stats_result");
+    cJSON_AddStringToObject(result, "deviceID", get_mac_addr_str());
+    cJSON_AddNumberToObject(result, "congestion", congestion_get_level());
+    cJSON* item = cJSON_AddObjectToObject(result, "send_queue");
+    cJSON_AddNumberToObject(item, "sent", queue_stats.sent);
+    cJSON_AddNumberToObject(item, "retried", queue_stats.retried);
+    cJSON_AddNumberToObject(item, "expired", queue_stats.expired);
+    cJSON_AddNumberToObject(item, "rejected", queue_stats.rejected);
+    cJSON_AddNumberToObject(item, "evicted", queue_stats.evicted);
+    cJSON_AddNumberToObject(item, "coalesced", queue_stats.coalesced);
+    item = cJSON_AddObjectToObject(result, "publish_queue");
+    cJSON_AddNumberToObject(item, "queued", publish_stats.queued);
+    cJSON_AddNumberToObject(item, "dropped", publish_stats.dropped);
+    item = cJSON_AddObjectToObject(result, "mesh_frag");
+    cJSON_AddNumberToObject(item, "fragmented", frag_stats.fragmented);
+    cJSON_AddNumberToObject(item, "reassembled", frag_stats.reassembled);
+    cJSON_AddNumberToObject(item, "timeouts", frag_stats.timeouts);
+    cJSON_AddNumberToObject(item, "dropped", frag_stats.dropped);
+    msg_buf_get_stats(&buf_stats);
+    item = cJSON_AddObjectToObject(result, "msg_buf");
+    cJSON_AddNumberToObject(item, "pool_size", buf_stats.pool_size);
+    cJSON_AddNumberToObject(item, "pool_used", buf_stats.pool_used);
+    cJSON_AddNumberToObject(item, "pool_peak", buf_stats.pool_peak);
+    cJSON_AddNumberToObject(item, "heap_used", buf_stats.heap_used);
+    cJSON_AddNumberToObject(item, "pool_allocs", buf_stats.pool_allocs);
+    cJSON_AddNumberToObject(item, "heap_allocs", buf_stats.heap_allocs);
+    broker_select_add_to_json(cJSON_AddArrayToObject(result, "brokers"));
+    mqtt_root_add_to_json(cJSON_AddArrayToObject(result, "mqtt_shards"));
+    rate_limit_add_to_json(cJSON_AddObjectToObject(result, "rate_limit"));
+    telemetry_dedup_add_to_json(cJSON_AddObjectToObject(result, "dedup"));
+
+    char* result_str = cJSON_PrintUnformatted(result);
+    mqtt_root_publish(result_str, TRAFFIC_CLASS_COMMAND);
+    free(result_str);
+    cJSON_Delete(result);
+}
+
+/* {"action":"brokers","uris":["mqtt://..",..]} in order of preference */
+static void brokers_action_handler(cJSON* uris) {
+    char   list[BROKER_LIST_LEN] = "";
+    size_t len                   = 0;
+    cJSON* uri;
+    if (!cJSON_IsArray(uris)) return;
+    cJSON_ArrayForEach(uri, uris) {
+        if (!cJSON_IsString(uri)) continue;
+        size_t uri_len = strlen(uri->valuestring);
+        if (uri_len == 0 || uri_len >= BROKER_URI_LEN ||
+            len + uri_len + 2 > sizeof(list))
+            continue;
+        if (len) list[len++] = ',';
+        strcpy(list + len, uri->valuestring);
+        len += uri_len;
+    }
+    broker_select_set_list(list);
+}
+
+static void device_action_dispatch(cJSON* data_json) {
     cJSON* action_object = cJSON_GetObjectItem(data_json, "action");
-    if (cJSON_IsString(action_object)) {
+    cJSON* commands      = cJSON_GetObjectItem(data_json, "commands");
+    if (cJSON_IsString(action_object) && cJSON_IsArray(commands) &&
+        strcmp(action_object->valuestring, "command") == 0) {
+        batch_command_handler(data_json, commands);
+    } else if (cJSON_IsString(action_object) &&
+               strcmp(action_object->valuestring, "get") == 0) {
+        get_action_handler(data_json);
+    } else if (cJSON_IsString(action_object) &&
+               strcmp(action_object->valuestring, "stats") == 0) {
+        stats_action_handler();
+    } else if (cJSON_IsString(action_object) &&
+               strcmp(action_object->valuestring, "rate_limit") == 0) {
+        cJSON* rate  = cJSON_GetObjectItem(data_json, "rate");
+        cJSON* burst = cJSON_GetObjectItem(data_json, "burst");
+        if (cJSON_IsNumber(rate) && cJSON_IsNumber(burst) &&
+            rate->valuedouble >= 0 && burst->valuedouble >= 0) {
+            rate_limit_configure(rate->valuedouble, burst->valuedouble);
+        }
+    } else if (cJSON_IsString(action_object) &&
+               strcmp(action_object->valuestring, "dedup") == 0) {
+        cJSON* interval = cJSON_GetObjectItem(data_json, "interval");
+        if (cJSON_IsNumber(interval) && interval->valuedouble >= 0) {
+            telemetry_dedup_set_interval(interval->valuedouble * 1000);
+        }
+    } else if (cJSON_IsString(action_object) &&
+               strcmp(action_object->valuestring, "topology") == 0) {
+        topology_request_full();
+    } else if (cJSON_IsString(action_object) &&
+               strcmp(action_object->valuestring, "brokers") == 0) {
+        brokers_action_handler(cJSON_GetObjectItem(data_json, "uris"));
+    } else if (cJSON_IsString(action_object) &&
+               strcmp(action_object->valuestring, "snapshot") == 0) {
+        cJSON* interval = cJSON_GetObjectItem(data_json, "interval");
+        if (cJSON_IsNumber(interval) && interval->valuedouble >= 0) {
+            snapshot_set_interval(interval->valuedouble * 1000);
+        }
+    } else if (cJSON_IsString(action_object)) {
         cJSON* device_id_object = cJSON_GetObjectItem(data_json, "deviceID");
         if (cJSON_IsString(device_id_object)) {
             char* device_id_str = device_id_object->valuestring;
             if (strcmp(action_object->valuestring, "command") == 0) {
                 cJSON* channel_data =
                     cJSON_GetObjectItem(data_json, "channels");
-                command_action_handler(device_id_str, channel_data);
+                cJSON* id  = cJSON_GetObjectItem(data_json, "id");
+                int    cmd = cmd_tracker_begin(id);
+                command_action_handler(device_id_str, channel_data, cmd,
+                                       cmd_tracker_seq(id));
+                cmd_tracker_end(cmd);
             } else if (strcmp(action_object->valuestring, "provision") == 0) {
                 provision_action_handler(device_id_str);
+            } else if (strcmp(action_object->valuestring, "group") == 0) {
+                group_action_handler(device_id_str, data_json);
             }
         }
     }
+}
+
+/* down/MAC/<root>: actions carry their deviceID in the payload */
+static void device_topic_handler(const topic_match_t* match,
+                                 const char*          data,
+                                 int                  data_len) {
+    cJSON* data_json = cJSON_ParseWithLength(data, data_len);
+    device_action_dispatch(data_json);
     cJSON_Delete(data_json);
 }
 
+/* down/NODE/<root>/<deviceID>: the topic addresses the device */
+static void node_topic_handler(const topic_match_t* match,
+                               const char*          data,
+                               int                  data_len) {
+    if (match->wildcard_len != 12) return;
+    char device_id[13];
+    memcpy(device_id, match->wildcard, 12);
+    device_id[12] = '\0';
+
+    cJSON* data_json = cJSON_ParseWithLength(data, data_len);
+    if (cJSON_IsObject(data_json)) {
+        cJSON_DeleteItemFromObject(data_json, "deviceID");
+        cJSON_AddStringToObject(data_json, "deviceID", device_id);
+        device_action_dispatch(data_json);
+    }
+    cJSON_Delete(data_json);
+}
+
+/* down/GROUP/<root>/<name> */
+static void group_topic_handler(const topic_match_t* match,
+                                const char*          data,
+                                int                  data_len) {
+    if (match->wildcard_len >= NODE_GROUP_NAME_LEN) return;
+    char group_name[NODE_GROUP_NAME_LEN];
+    memcpy(group_name, match->wildcard, match->wildcard_len);
+    group_name[match->wildcard_len] = '\0';
+
+    cJSON* data_json = cJSON_ParseWithLength(data, data_len);
+    group_command_handler(group_name, data_json);
+    cJSON_Delete(data_json);
+}
+
+/* down/BROADCAST/<root>: one broadcast frame for every node of the mesh.
+ * {"action":"all_off"} is the emergency all-off, it bypasses every queue */
+static void broadcast_topic_handler(const topic_match_t* match,
+                                    const char*          data,
+                                    int                  data_len) {
+    cJSON* data_json     = cJSON_ParseWithLength(data, data_len);
+    cJSON* action_object = cJSON_GetObjectItem(data_json, "action");
+    cJSON* channel_data  = cJSON_GetObjectItem(data_json, "channels");
+    if (cJSON_IsString(action_object) &&
+        strcmp(action_object->valuestring, "all_off") == 0) {
+        send_emergency_to_all(EMERGENCY_ALL_OFF_FRAME);
+        turn_all_off();
+        root_telemetry();
+    } else if (cJSON_IsString(action_object) &&
+               strcmp(action_object->valuestring, "command") == 0 &&
+               cJSON_IsObject(channel_data)) {
+        char* channels_str = cJSON_PrintUnformatted(channel_data);
+        send_to_all(channels_str);
+        free(channels_str);
+        apply_channels(channel_data);
+    }
+    cJSON_Delete(data_json);
+}
+
+static void register_topic_routes(void) {
+    char topic[48];
+    mqtt_root_add_route(get_down_topic(), device_topic_handler);
+    sprintf(topic, "down/NODE/%s/+", get_mac_addr_str());
+    mqtt_root_add_route(topic, node_topic_handler);
+    sprintf(topic, "down/GROUP/%s/+", get_mac_addr_str());
+    mqtt_root_add_route(topic, group_topic_handler);
+    sprintf(topic, "down/BROADCAST/%s", get_mac_addr_str());
+    mqtt_root_add_route(topic, broadcast_topic_handler);
+}
+
 void app_main() {
     ESP_ERROR_CHECK(nvs_flash_init());
     ESP_ERROR_CHECK(nvs_open("main", NVS_READWRITE, &nvs_handler));
@@ -358,10 +830,19 @@ void app_main() {
 
     ind_led_init();
 
+    node_group_init();
+    device_shadow_init();
+    prov_ledger_init();
+    send_queue_init();
+    cmd_tracker_init();
+    rate_limit_init();
+    telemetry_dedup_init();
     root_config();
     xTaskCreate(mesh_root_receive, "receive", 10240, NULL, 5, NULL);
 
-    mqtt_receive_set_call_back(mqtt_root_receive);
+    register_topic_routes();
+    snapshot_init();
+    rtt_probe_init();
 
     create_device_channel();
     root_provision();
@@ -4,7 +4,11 @@
 #include <mqtt_client.h>
 #include <string.h>
 
+#include "broker_select.h"
+#include "congestion.h"
 #include "device.h"
+#include "device_shadow.h"
+#include "esp_crt_bundle.h"
 #include "esp_log.h"
 #include "esp_mesh.h"
 #include "esp_netif.h"
@@ -13,7 +17,13 @@
 #include "esp_wifi.h"
 #include "freertos/event_groups.h"
 #include "led_indicator.h"
+#include "mesh_frag.h"
 #include "nvs_flash.h"
+#include "publish_queue.h"
+#include "send_queue.h"
+#include "topic_router.h"
+#include "topology.h"
+#include "traffic_class.h"
 
 // #define CONFIG_MESH_IE_CRYPTO_KEY "topsecret"
 #define CONFIG_MESH_NON_MESH_AP_CONNECTIONS 0
@@ -21,9 +31,19 @@
 #define CONFIG_MESH_AP_CONNECTIONS          6
 #define CONFIG_MESH_AP_PASSWD               "topsecret"
 #define CONFIG_MESH_TOPOLOGY                0
-#define MQTT_BROKER_ADDRESS                 "mqtt://172.29.5.92"
-// #define MQTT_BROKER_ADDRESS                 "mqtt://mqtt.eclipseprojects.io"
+/* Comma separated, the first one is preferred until latencies are known */
+#define MQTT_BROKER_LIST                    "mqtt://172.29.5.92"
+// #define MQTT_BROKER_LIST "mqtt://172.29.5.92,mqtt://mqtt.eclipseprojects.io"
+// #define MQTT_BROKER_LIST "mqtts://mqtt.eclipseprojects.io"
+#define MQTT_RECONNECT_TIMEOUT_MS           2000
+#define MQTT_SHARD_COUNT                    1 /* Publishing connections */
 #define MQTT_CONNECTED_BIT                  (1 << 15)
+#define MQTT_INBOUND_MAX_SIZE               8192
+#define MQTT_INBOUND_MAX_TOPIC              128
+#define MQTT_INBOUND_POOL_SIZE              2
+#define MQTT_RETAINED_STATE                 true
+#define STATE_TOPIC_PREFIX                  "state/MAC/"
+#define STATE_RESYNC_RATE                   5 /* Nodes per second */
 
 esp_netif_t *                   sta_netif;
 uint8_t                         is_configured;
@@ -42,19 +62,142 @@ static char *                   down_topic;
 static char *                   mac_addr_str;
 static EventGroupHandle_t       event_group;
 static esp_mqtt_client_handle_t mqtt_client;
-void (*input_call_back)(char *topic, char *data) = NULL;
+static TaskHandle_t             resync_task;
+static TaskHandle_t             emergency_task_handle;
+static const char *             emergency_data;
+
+/* Node traffic is spread over the connections by node, the first one is
+ * the primary connection. It carries the subscriptions and the messages of
+ * the root itself */
+typedef struct {
+    esp_mqtt_client_handle_t client;
+    TaskHandle_t             publish_task;
+    bool                     connected;
+    uint32_t                 published; /* Accepted by the client */
+    uint32_t                 failed;    /* Refused by the client */
+    uint32_t                 offline;   /* Not queued, shard disconnected */
+} mqtt_shard_t;
+
+static mqtt_shard_t mqtt_shards[MQTT_SHARD_COUNT];
+
+/* Reassembly buffers for MQTT messages split over several DATA events.
+ * Events of one client are delivered in order by its MQTT task */
+typedef struct {
+    esp_mqtt_client_handle_t client;
+    char                     topic[MQTT_INBOUND_MAX_TOPIC];
+    int                      topic_len;
+    int                      total_len;
+    int                      received;
+    char                     data[MQTT_INBOUND_MAX_SIZE];
+} mqtt_inbound_buf_t;
+
+static mqtt_inbound_buf_t inbound_pool[MQTT_INBOUND_POOL_SIZE];
+
+static mqtt_inbound_buf_t *mqtt_inbound_get_buf(
+    esp_mqtt_client_handle_t client) {
+    mqtt_inbound_buf_t *free_buf = NULL;
+    for (uint8_t i = 0; i < MQTT_INBOUND_POOL_SIZE; i++) {
+        if (inbound_pool[i].client == client) return &inbound_pool[i];
+        if (inbound_pool[i].client == NULL && free_buf == NULL)
+            free_buf = &inbound_pool[i];
+    }
+    if (free_buf != NULL) free_buf->client = client;
+    return free_buf;
+}
+
+static void mqtt_inbound_data(esp_mqtt_event_handle_t event) {
+    /* Whole message in one event: dispatch in place, nothing is copied */
+    if (event->current_data_offset == 0 &&
+        event->data_len == event->total_data_len) {
+        topic_router_dispatch(event->topic, event->topic_len, event->data,
+                              event->data_len);
+        return;
+    }
+
+    mqtt_inbound_buf_t *buf = mqtt_inbound_get_buf(event->client);
+    if (buf == NULL) return;
+
+    /* Only the first fragment carries the topic */
+    if (event->current_data_offset == 0) {
+        if (event->total_data_len > MQTT_INBOUND_MAX_SIZE ||
+            event->topic_len > MQTT_INBOUND_MAX_TOPIC) {
+            ESP_LOGW("MQTT", "Drop inbound message of %d bytes",
+                     event->total_data_len);
+            buf->total_len = 0;
+            return;
+        }
+        memcpy(buf->topic, event->topic, event->topic_len);
+        buf->topic_len = event->topic_len;
+        buf->total_len = event->total_data_len;
+        buf->received  = 0;
+    }
+    if (buf->total_len == 0 || event->current_data_offset != buf->received ||
+        buf->received + event->data_len > buf->total_len) {
+        buf->total_len = 0;
+        return;
+    }
+
+    memcpy(buf->data + buf->received, event->data, event->data_len);
+    buf->received += event->data_len;
+    if (buf->received == buf->total_len) {
+        topic_router_dispatch(buf->topic, buf->topic_len, buf->data,
+                              buf->total_len);
+        buf->total_len = 0;
+    }
+}
+
+/* Secondary connections only publish, they follow the broker of the
+ * primary one */
+static void mqtt_shard_event(uint8_t index, esp_mqtt_event_handle_t event) {
+    mqtt_shard_t *shard = &mqtt_shards[index];
+    char          uri[BROKER_URI_LEN];
+    switch (event->event_id) {
+        case MQTT_EVENT_CONNECTED:
+            ESP_LOGI("MQTT", "Shard %d connected", index);
+            shard->connected = true;
+            xTaskNotifyGive(shard->publish_task);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            ESP_LOGI("MQTT", "Shard %d disconnected", index);
+            shard->connected = false;
+            broker_select_current(uri);
+            esp_mqtt_client_set_uri(shard->client, uri);
+            break;
+        default:
+            break;
+    }
+}
 
 void MQTT_event_handler(void *arg, esp_event_base_t event_base,
                         int32_t event_id, void *event_data) {
     char                    MQTT_TAG[] = "MQTT";
     esp_mqtt_event_handle_t event      = (esp_mqtt_event_handle_t)event_data;
+    char                    uri[BROKER_URI_LEN];
+    for (uint8_t i = 1; i < MQTT_SHARD_COUNT; i++) {
+        if (event->client == mqtt_shards[i].client) {
+            mqtt_shard_event(i, event);
+            return;
+        }
+    }
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED: {
             ind_led_set_state(IND_LED_ON);
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_CONNECTED");
+            /* Connected first, a route added while the patterns are walked
+             * is then either seen here or subscribed by its adder */
+            mqtt_connected           = true;
+            mqtt_shards[0].connected = true;
+            for (int i = 0; i < topic_router_count(); i++) {
+                esp_mqtt_client_subscribe(mqtt_client, topic_router_pattern(i),
+                                          0);
+            }
             xEventGroupSetBits(event_group, MQTT_CONNECTED_BIT);
-            esp_mqtt_client_subscribe(mqtt_client, down_topic, 0);
-            mqtt_connected = true;
+            broker_select_connected();
+            esp_mesh_post_toDS_state(true);
+            congestion_set_mqtt(true);
+            /* The cloud may have missed diffs while we were away */
+            topology_request_full();
+            xTaskNotifyGive(resync_task);
             break;
         }
         case MQTT_EVENT_DISCONNECTED:
@@ -62,7 +205,16 @@ void MQTT_event_handler(void *arg, esp_event_base_t event_base,
                 ind_led_set_state(IND_LED_WAIT_CONNECT_MQTT);
             }
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_DISCONNECTED");
-            mqtt_connected = false;
+            mqtt_connected           = false;
+            mqtt_shards[0].connected = false;
+            /* The client retries the new broker after its backoff */
+            if (broker_select_disconnected(wifi_connected)) {
+                broker_select_current(uri);
+                esp_mqtt_client_set_uri(mqtt_client, uri);
+            }
+            /* Nodes learn that the cloud is unreachable */
+            esp_mesh_post_toDS_state(false);
+            congestion_set_mqtt(false);
             break;
         case MQTT_EVENT_SUBSCRIBED: {
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_SUBSCRIBED");
@@ -73,23 +225,12 @@ void MQTT_event_handler(void *arg, esp_event_base_t event_base,
             break;
         case MQTT_EVENT_PUBLISHED:
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_PUBLISHED");
+            device_shadow_acked(event->msg_id);
+            broker_select_acked(event->msg_id);
             break;
         case MQTT_EVENT_DATA: {
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_DATA");
-
-            /* Allocate memory for data */
-            char *topic = malloc(event->topic_len + 1);
-            char *data  = malloc(event->data_len + 1);
-
-            sprintf(topic, "%.*s", event->topic_len, event->topic);
-            sprintf(data, "%.*s", event->data_len, event->data);
-
-            /* Handle received data */
-            input_call_back(topic, data);
-
-            /* Free memory after handling data */
-            free(topic);
-            free(data);
+            mqtt_inbound_data(event);
             break;
         }
         case MQTT_EVENT_ERROR:
@@ -123,6 +264,7 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
                 (mesh_event_child_connected_t *)event_data;
             ESP_LOGI(MESH_TAG, "<MESH_EVENT_CHILD_CONNECTED>aid:%d, " MACSTR "",
                      child_connected->aid, MAC2STR(child_connected->mac));
+            topology_child_connected(child_connected->mac);
         } break;
         case MESH_EVENT_CHILD_DISCONNECTED: {
             mesh_event_child_disconnected_t *child_disconnected =
@@ -130,6 +272,7 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
             ESP_LOGI(MESH_TAG,
                      "<MESH_EVENT_CHILD_DISCONNECTED>aid:%d, " MACSTR "",
                      child_disconnected->aid, MAC2STR(child_disconnected->mac));
+            topology_child_disconnected(child_disconnected->mac);
         } break;
         case MESH_EVENT_ROUTING_TABLE_ADD: {
             mesh_event_routing_table_change_t *routing_table =
@@ -138,6 +281,7 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
                      "<MESH_EVENT_ROUTING_TABLE_ADD>add %d, new:%d, layer:%d",
                      routing_table->rt_size_change, routing_table->rt_size_new,
                      mesh_layer);
+            topology_routing_changed();
         } break;
         case MESH_EVENT_ROUTING_TABLE_REMOVE: {
             mesh_event_routing_table_change_t *routing_table =
@@ -147,6 +291,7 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
                 "<MESH_EVENT_ROUTING_TABLE_REMOVE>remove %d, new:%d, layer:%d",
                 routing_table->rt_size_change, routing_table->rt_size_new,
                 mesh_layer);
+            topology_routing_changed();
         } break;
         case MESH_EVENT_NO_PARENT_FOUND: {
             mesh_event_no_parent_found_t *no_parent =
@@ -236,6 +381,7 @@ static void mesh_event_handler(void *arg, esp_event_base_t event_base,
                 (mesh_event_toDS_state_t *)event_data;
             ESP_LOGI(MESH_TAG, "<MESH_EVENT_TODS_REACHABLE>state:%d",
                      *toDs_state);
+            congestion_set_tods(*toDs_state == MESH_TODS_REACHABLE);
         } break;
         case MESH_EVENT_ROOT_FIXED: {
             mesh_event_root_fixed_t *root_fixed =
@@ -325,15 +471,41 @@ static void ip_event_handler(void *arg, esp_event_base_t event_base,
         // reset
         esp_restart();
     }
+    /* The client lives across Wi-Fi flaps, a new IP only cuts the reconnect
+     * backoff short. Every reconnect is still a full TLS handshake, this
+     * esp-mqtt cannot hand a saved session to esp-tls */
+    if (mqtt_client != NULL) {
+        for (uint8_t i = 0; i < MQTT_SHARD_COUNT; i++) {
+            esp_mqtt_client_reconnect(mqtt_shards[i].client);
+        }
+        return;
+    }
+    char                     client_id[32];
+    char                     uri[BROKER_URI_LEN];
+    broker_select_current(uri);
     esp_mqtt_client_config_t mqtt_cfg = {
-        .uri = MQTT_BROKER_ADDRESS,
+        .uri                  = uri,
+        .reconnect_timeout_ms = MQTT_RECONNECT_TIMEOUT_MS,
+        /* mqtts:// brokers are verified against the IDF CA bundle */
+        .crt_bundle_attach = esp_crt_bundle_attach,
     };
-    mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
-    esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID,
-                                   MQTT_event_handler, mqtt_client);
-    esp_mqtt_client_start(mqtt_client);
-    ESP_ERROR_CHECK(esp_event_handler_register("MQTT_EVENTS", ESP_EVENT_ANY_ID,
-                                               &MQTT_event_handler, NULL));
+    for (uint8_t i = 0; i < MQTT_SHARD_COUNT; i++) {
+        /* The primary keeps the default client ID */
+        if (i > 0) {
+            sprintf(client_id, "ESP32_%s_%d", mac_addr_str, i);
+            mqtt_cfg.client_id = client_id;
+        }
+        mqtt_shards[i].client = esp_mqtt_client_init(&mqtt_cfg);
+        esp_mqtt_client_register_event(mqtt_shards[i].client,
+                                       ESP_EVENT_ANY_ID, MQTT_event_handler,
+                                       mqtt_shards[i].client);
+    }
+    /* Every handle is set before the first CONNECTED event can look them
+     * up by client */
+    mqtt_client = mqtt_shards[0].client;
+    for (uint8_t i = 0; i < MQTT_SHARD_COUNT; i++) {
+        esp_mqtt_client_start(mqtt_shards[i].client);
+    }
 }
 
 static void sc_event_handler(void *arg, esp_event_base_t event_base,
@@ -443,6 +615,117 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
     }
 }
 
+/* Jump consistent hash of the node MAC, so changing MQTT_SHARD_COUNT moves
+ * as few nodes as possible. The root's own messages use the primary */
+static uint8_t mqtt_shard_of(const mesh_addr_t *src) {
+    if (src == NULL) return 0;
+    uint64_t key = 14695981039346656037ULL;
+    for (uint8_t i = 0; i < 6; i++) {
+        key = (key ^ src->addr[i]) * 1099511628211ULL;
+    }
+    int64_t b = 0;
+    int64_t j = 0;
+    while (j < MQTT_SHARD_COUNT) {
+        b   = j;
+        key = key * 2862933555777941757ULL + 1;
+        j   = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+    }
+    return b;
+}
+
+/* One task per connection drains its shard of the publish queue in strict
+ * class priority order, so commands and their results overtake any
+ * telemetry backlog. Within a class the sources take turns. A secondary
+ * connection keeps its backlog while it reconnects, the primary drops it */
+static void mqtt_publish_task(void *arg) {
+    uint8_t         index = (uintptr_t)arg;
+    mqtt_shard_t   *shard = &mqtt_shards[index];
+    publish_msg_t   msg;
+    traffic_class_t c;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while ((index == 0 || shard->connected) &&
+               publish_queue_pop(&msg, &c, index)) {
+            if (shard->connected) {
+                /* Only acks of a state publish are kept for its shadow */
+                if (msg.version) device_shadow_publishing();
+                int msg_id = esp_mqtt_client_publish(
+                    shard->client, msg.topic ? msg.topic : up_topic,
+                    msg.data->data, msg.data->len,
+                    traffic_class_cfg[c].mqtt_qos, msg.retain);
+                if (msg_id < 0) {
+                    shard->failed++;
+                } else {
+                    shard->published++;
+                }
+                if (msg.version) {
+                    device_shadow_set_pending(
+                        msg.topic + sizeof(STATE_TOPIC_PREFIX) - 1,
+                        msg.version, msg_id);
+                }
+                if (index == 0 && traffic_class_cfg[c].mqtt_qos &&
+                    msg_id > 0) {
+                    broker_select_sent(msg_id);
+                }
+            }
+            publish_msg_free(&msg);
+        }
+    }
+}
+
+/* After a reconnect publish the nodes whose state changed while the link
+ * was down, paced so a large mesh does not flood the broker */
+static void state_resync_task(void *arg) {
+    char device_id[13];
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int index = 0;
+        int count = 0;
+        while (mqtt_connected &&
+               (index = device_shadow_next_unacked(index, device_id)) >= 0) {
+            mqtt_root_publish_state(device_id);
+            index++;
+            count++;
+            vTaskDelay(pdMS_TO_TICKS(1000 / STATE_RESYNC_RATE));
+        }
+        ESP_LOGI("MQTT", "Resynchronized %d nodes", count);
+    }
+}
+
+static void mqtt_publish_init(void) {
+    publish_queue_init();
+    xTaskCreate(state_resync_task, "resync", 3072, NULL, 3, &resync_task);
+    for (uintptr_t i = 0; i < MQTT_SHARD_COUNT; i++) {
+        xTaskCreate(mqtt_publish_task, "publish", 4096, (void *)i, 5,
+                    &mqtt_shards[i].publish_task);
+    }
+}
+
+/* Emergency frames skip the send queue and go out with the highest mesh
+ * priority. Broadcasts are not acknowledged, so the frame is repeated. The
+ * sends never block, a full mesh queue costs one repeat, not the caller */
+static void emergency_task(void *arg) {
+    mesh_addr_t broadcast_addr = MESH_BROADCAST_ADDR;
+    mesh_data_t send_data;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        send_data.data  = (uint8_t *)emergency_data;
+        send_data.size  = strlen(emergency_data);
+        send_data.proto = MESH_PROTO_BIN;
+        send_data.tos   = MESH_TOS_P2P;
+        for (uint8_t i = 0; i < EMERGENCY_REPEAT; i++) {
+            if (i > 0) vTaskDelay(pdMS_TO_TICKS(EMERGENCY_REPEAT_MS));
+            esp_mesh_send(&broadcast_addr, &send_data,
+                          MESH_DATA_FROMDS | MESH_DATA_NONBLOCK, NULL, 0);
+        }
+    }
+}
+
+void send_emergency_to_all(const char *data) {
+    emergency_data = data;
+    xTaskNotifyGive(emergency_task_handle);
+}
+
 void root_config(void) {
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
@@ -469,16 +752,92 @@ void root_config(void) {
                                                &sc_event_handler, NULL));
 
     event_group = xEventGroupCreate();
+    topic_router_init();
+    broker_select_init(MQTT_BROKER_LIST);
+    mqtt_publish_init();
+    xTaskCreate(emergency_task, "emergency", 2048, NULL, 10,
+                &emergency_task_handle);
+    congestion_init();
+    topology_init();
     ESP_ERROR_CHECK(esp_wifi_start());
     xEventGroupWaitBits(event_group, MQTT_CONNECTED_BIT, true, false,
                         portMAX_DELAY);
 }
 
-void mqtt_receive_set_call_back(void *cb) { input_call_back = cb; }
+/* Leave the current broker for uri, the disconnect is expected */
+void mqtt_root_switch_broker(const char *uri) {
+    if (mqtt_client == NULL) return;
+    for (uint8_t i = 0; i < MQTT_SHARD_COUNT; i++) {
+        esp_mqtt_client_set_uri(mqtt_shards[i].client, uri);
+        esp_mqtt_client_disconnect(mqtt_shards[i].client);
+        esp_mqtt_client_reconnect(mqtt_shards[i].client);
+    }
+}
+
+void mqtt_root_add_route(const char *pattern, topic_handler_t handler) {
+    if (topic_router_add(pattern, handler) && mqtt_connected) {
+        esp_mqtt_client_subscribe(mqtt_client, pattern, 0);
+    }
+}
 
-void mqtt_root_publish(char *data) {
-    if (mqtt_connected) {
-        esp_mqtt_client_publish(mqtt_client, up_topic, data, 0, 1, 0);
+/* Queue a message on the connection of its source, the queue takes it.
+ * Each shard is gated on its own connection, not on the primary */
+static void mqtt_root_queue(const mesh_addr_t *src, publish_msg_t *msg,
+                            traffic_class_t traffic_class) {
+    msg->shard = mqtt_shard_of(src);
+    if (!mqtt_shards[msg->shard].connected) {
+        mqtt_shards[msg->shard].offline++;
+        publish_msg_free(msg);
+        return;
+    }
+    if (publish_queue_push(src, msg, traffic_class)) {
+        xTaskNotifyGive(mqtt_shards[msg->shard].publish_task);
+    }
+}
+
+void mqtt_root_publish_buf(const mesh_addr_t *src, msg_buf_t *buf,
+                           traffic_class_t traffic_class) {
+    publish_msg_t msg = {.data = msg_buf_ref(buf)};
+    mqtt_root_queue(src, &msg, traffic_class);
+}
+
+void mqtt_root_publish_from(const mesh_addr_t *src, char *data,
+                            traffic_class_t traffic_class) {
+    publish_msg_t msg = {.data = msg_buf_from_str(data)};
+    if (msg.data == NULL) return;
+    mqtt_root_queue(src, &msg, traffic_class);
+}
+
+/* {"deviceID","version","channels"} on state/MAC/<deviceID>, retained so a
+ * new subscriber gets the state of every node at once. The broker
+ * acknowledgement marks the version as delivered */
+void mqtt_root_publish_state(const char *device_id) {
+    if (!mqtt_shards[0].connected) return;
+
+    publish_msg_t msg = {.retain = MQTT_RETAINED_STATE};
+    msg.data  = msg_buf_wrap(device_shadow_print(device_id, &msg.version));
+    msg.topic = malloc(sizeof(STATE_TOPIC_PREFIX) + 12);
+    if (msg.data == NULL || msg.topic == NULL) {
+        publish_msg_free(&msg);
+        return;
+    }
+    sprintf(msg.topic, STATE_TOPIC_PREFIX "%s", device_id);
+    /* Shadow acknowledgements are matched by message ID of the primary */
+    mqtt_root_queue(NULL, &msg, TRAFFIC_CLASS_TELEMETRY);
+}
+
+void mqtt_root_publish(char *data, traffic_class_t traffic_class) {
+    mqtt_root_publish_from(NULL, data, traffic_class);
+}
+
+void mqtt_root_add_to_json(cJSON *array) {
+    for (uint8_t i = 0; i < MQTT_SHARD_COUNT; i++) {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddBoolToObject(item, "connected", mqtt_shards[i].connected);
+        cJSON_AddNumberToObject(item, "published", mqtt_shards[i].published);
+        cJSON_AddNumberToObject(item, "failed", mqtt_shards[i].failed);
+        cJSON_AddNumberToObject(item, "offline", mqtt_shards[i].offline);
+        cJSON_AddItemToArray(array, item);
     }
 }
 
@@ -488,8 +847,8 @@ void root_provision() {
         if (!is_provisioned) {
             while (is_provisioned != 1) {
                 char *mqtt_prov_data = device_get_mqtt_provision_json_data();
-                esp_mqtt_client_publish(mqtt_client, up_topic, mqtt_prov_data,
-                                        0, 1, 0);
+                mqtt_root_publish(mqtt_prov_data, TRAFFIC_CLASS_PROVISION);
+                free(mqtt_prov_data);
                 vTaskDelay(30000 / portTICK_PERIOD_MS);
             }
         }
@@ -499,19 +858,39 @@ void root_provision() {
 void root_set_is_provisioned(bool value) { is_provisioned = value; }
 
 void root_telemetry() {
-    if (mqtt_connected) {
-        char *mqtt_tele_data = device_get_mqtt_state_json_data();
-        esp_mqtt_client_publish(mqtt_client, up_topic, mqtt_tele_data, 0, 1, 0);
+    char *mqtt_tele_data = device_get_mqtt_state_json_data();
+    if (device_shadow_update(mac_addr_str, mqtt_tele_data)) {
+        mqtt_root_publish_state(mac_addr_str);
     }
+    mqtt_root_publish(mqtt_tele_data, TRAFFIC_CLASS_TELEMETRY);
+    free(mqtt_tele_data);
 }
 
-void send_to_node(mesh_addr_t node_addr, char *data) {
-    mesh_data_t send_data;
-    send_data.data  = (uint8_t *)data;
-    send_data.size  = strlen(data);
-    send_data.proto = MESH_PROTO_BIN;
-    send_data.tos   = MESH_DATA_FROMDS;
-    esp_mesh_send(&node_addr, &send_data, MESH_DATA_FROMDS, NULL, 0);
+/* Queued per destination, the actual mesh send happens in send_queue task */
+esp_err_t send_to_node(mesh_addr_t node_addr, char *data,
+                       traffic_class_t traffic_class) {
+    return send_queue_push(&node_addr, data, traffic_class);
+}
+
+/* Channel commands to a node are coalesced in its queue */
+esp_err_t send_channels_to_node(mesh_addr_t node_addr, cJSON *channels,
+                                uint32_t *seq) {
+    return send_queue_push_channels(&node_addr, channels, seq);
+}
+
+/* One mesh frame reaches every node that joined the group ID */
+void send_to_group(mesh_addr_t group_addr, char *data) {
+    mesh_frag_send(&group_addr, data, strlen(data),
+                   traffic_class_cfg[TRAFFIC_CLASS_COMMAND].mesh_tos,
+                   MESH_DATA_GROUP);
+}
+
+/* Every node of the mesh receives the frame */
+void send_to_all(char *data) {
+    mesh_addr_t broadcast_addr = MESH_BROADCAST_ADDR;
+    mesh_frag_send(&broadcast_addr, data, strlen(data),
+                   traffic_class_cfg[TRAFFIC_CLASS_COMMAND].mesh_tos,
+                   MESH_DATA_FROMDS);
 }
 
 char *get_up_topic() { return up_topic; }
@@ -1,16 +1,54 @@
 #pragma once
+#include <cJSON.h>
+
 #include "esp_mesh.h"
+#include "msg_buf.h"
 #include "nvs_flash.h"
+#include "topic_router.h"
+#include "traffic_class.h"
+
+#define MESH_BROADCAST_ADDR                                                    \
+    {                                                                          \
+        .addr = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF }                         \
+    }
+
+#define EMERGENCY_REPEAT    3
+#define EMERGENCY_REPEAT_MS 20 /* Spacing of the repeats */
 
 extern nvs_handle_t nvs_handler;
 
 void                root_config(void);
-void                mqtt_receive_set_call_back(void* cb);
-void                mqtt_root_publish(char* data);
+void                mqtt_root_switch_broker(const char* uri);
+void                mqtt_root_add_route(const char*     pattern,
+                                        topic_handler_t handler);
+void                mqtt_root_publish(char*           data,
+                                      traffic_class_t traffic_class);
+/* Queue a reference to a message forwarded from a node, no copy is made */
+void                mqtt_root_publish_buf(const mesh_addr_t* src,
+                                          msg_buf_t*         buf,
+                                          traffic_class_t    traffic_class);
+/* Same as mqtt_root_publish for a message forwarded from a node */
+void                mqtt_root_publish_from(const mesh_addr_t* src,
+                                           char*              data,
+                                           traffic_class_t    traffic_class);
+/* Versioned state of a device from its shadow on its state topic */
+void                mqtt_root_publish_state(const char* device_id);
+/* Add [{"connected","published","failed","offline"}] per MQTT shard */
+void                mqtt_root_add_to_json(cJSON* array);
 void                root_provision();
 void                root_set_is_provisioned(bool value);
 void                root_telemetry();
-void                send_to_node(mesh_addr_t node_addr, char* data);
+esp_err_t           send_to_node(mesh_addr_t     node_addr,
+                                 char*           data,
+                                 traffic_class_t traffic_class);
+esp_err_t           send_channels_to_node(mesh_addr_t node_addr,
+                                          cJSON*      channels,
+                                          uint32_t*   seq);
+void                send_to_group(mesh_addr_t group_addr, char* data);
+void                send_to_all(char* data);
+/* Broadcast data from the emergency task and return at once, data must
+ * stay valid (a literal such as EMERGENCY_ALL_OFF_FRAME) */
+void                send_emergency_to_all(const char* data);
 char*               get_up_topic();
 char*               get_down_topic();
 char*               get_mac_addr_str();
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include "msg_buf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+static msg_buf_t       pool[MSG_BUF_POOL_SIZE];
+static char            pool_data[MSG_BUF_POOL_SIZE][MSG_BUF_SLOT_SIZE];
+static uint32_t        pool_free = (1ULL << MSG_BUF_POOL_SIZE) - 1;
+static msg_buf_stats_t buf_stats = {.pool_size = MSG_BUF_POOL_SIZE};
+static portMUX_TYPE    buf_lock  = portMUX_INITIALIZER_UNLOCKED;
+
+_Static_assert(MSG_BUF_POOL_SIZE <= 32, "pool_free is a 32 bit mask");
+
+static msg_buf_t* msg_buf_pool_take(void) {
+    msg_buf_t* buf = NULL;
+    portENTER_CRITICAL(&buf_lock);
+    if (pool_free) {
+        int slot = __builtin_ctz(pool_free);
+        pool_free &= ~(1UL << slot);
+        buf       = &pool[slot];
+        buf->data = pool_data[slot];
+        buf->len  = 0;
+        buf->refs = 1;
+        buf->slot = slot;
+        buf_stats.pool_allocs++;
+        if (++buf_stats.pool_used > buf_stats.pool_peak)
+            buf_stats.pool_peak = buf_stats.pool_used;
+    }
+    portEXIT_CRITICAL(&buf_lock);
+    return buf;
+}
+
+/* data is owned by the new buffer, freed here on failure */
+static msg_buf_t* msg_buf_heap_take(char* data) {
+    msg_buf_t* buf = malloc(sizeof(msg_buf_t));
+    if (data == NULL || buf == NULL) {
+        free(data);
+        free(buf);
+        return NULL;
+    }
+    buf->data = data;
+    buf->len  = 0;
+    buf->refs = 1;
+    buf->slot = -1;
+    portENTER_CRITICAL(&buf_lock);
+    buf_stats.heap_allocs++;
+    buf_stats.heap_used++;
+    portEXIT_CRITICAL(&buf_lock);
+    return buf;
+}
+
+msg_buf_t* msg_buf_alloc(void) {
+    msg_buf_t* buf = msg_buf_pool_take();
+    if (buf == NULL) buf = msg_buf_heap_take(malloc(MSG_BUF_SLOT_SIZE));
+    return buf;
+}
+
+msg_buf_t* msg_buf_from_str(const char* str) {
+    size_t     len = strlen(str);
+    msg_buf_t* buf = NULL;
+    if (len < MSG_BUF_SLOT_SIZE) buf = msg_buf_pool_take();
+    if (buf == NULL) buf = msg_buf_heap_take(malloc(len + 1));
+    if (buf == NULL) return NULL;
+    memcpy(buf->data, str, len + 1);
+    buf->len = len;
+    return buf;
+}
+
+msg_buf_t* msg_buf_wrap(char* str) {
+    if (str == NULL) return NULL;
+    msg_buf_t* buf = msg_buf_heap_take(str);
+    if (buf != NULL) buf->len = strlen(str);
+    return buf;
+}
+
+void msg_buf_set_len(msg_buf_t* buf, size_t len) {
+    buf->len = len;
+    if (buf->slot < 0 && len + 1 < MSG_BUF_SLOT_SIZE) {
+        char* data = realloc(buf->data, len + 1);
+        if (data != NULL) buf->data = data;
+    }
+}
+
+msg_buf_t* msg_buf_ref(msg_buf_t* buf) {
+    portENTER_CRITICAL(&buf_lock);
+    buf->refs++;
+    portEXIT_CRITICAL(&buf_lock);
+    return buf;
+}
+
+void msg_buf_unref(msg_buf_t* buf) {
+    if (buf == NULL) return;
+    portENTER_CRITICAL(&buf_lock);
+    bool last = --buf->refs == 0;
+    if (last && buf->slot >= 0) {
+        pool_free |= 1UL << buf->slot;
+        buf_stats.pool_used--;
+    } else if (last) {
+        buf_stats.heap_used--;
+    }
+    portEXIT_CRITICAL(&buf_lock);
+    if (last && buf->slot < 0) {
+        free(buf->data);
+        free(buf);
+    }
+}
+
+void msg_buf_get_stats(msg_buf_stats_t* stats) {
+    portENTER_CRITICAL(&buf_lock);
+    *stats = buf_stats;
+    portEXIT_CRITICAL(&buf_lock);
+}
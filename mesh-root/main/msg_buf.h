@@ -0,0 +1,48 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mesh_frag.h"
+
+/* A pool slot holds a whole mesh frame. Larger messages and the overflow of
+ * an exhausted pool live on the heap */
+#define MSG_BUF_POOL_SIZE 16
+#define MSG_BUF_SLOT_SIZE MESH_FRAG_RX_BUF_SIZE
+
+/* A message shared by the receive path, the shadow and the publisher
+ * without copying. Freed, or returned to the pool, with the last reference */
+typedef struct {
+    char*   data;
+    size_t  len;
+    uint8_t refs;
+    int8_t  slot; /* Pool slot, -1 for a heap buffer */
+} msg_buf_t;
+
+typedef struct {
+    uint16_t pool_size;
+    uint16_t pool_used;
+    uint16_t pool_peak;
+    uint16_t heap_used;
+    uint32_t pool_allocs;
+    uint32_t heap_allocs;
+} msg_buf_stats_t;
+
+/* A buffer of MSG_BUF_SLOT_SIZE bytes with one reference, taken from the
+ * pool when a slot is free. NULL when out of memory */
+msg_buf_t* msg_buf_alloc(void);
+
+/* Copy a string into a new buffer */
+msg_buf_t* msg_buf_from_str(const char* str);
+
+/* Take a heap string over, it is freed with the last reference */
+msg_buf_t* msg_buf_wrap(char* str);
+
+/* Length of the string received into a buffer, a heap buffer is shrunk to
+ * fit so it does not hold a whole frame while it waits in a queue */
+void       msg_buf_set_len(msg_buf_t* buf, size_t len);
+
+msg_buf_t* msg_buf_ref(msg_buf_t* buf);
+void       msg_buf_unref(msg_buf_t* buf);
+
+void       msg_buf_get_stats(msg_buf_stats_t* stats);
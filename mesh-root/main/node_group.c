@@ -0,0 +1,117 @@
+#include "node_group.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+extern nvs_handle_t nvs_handler;
+
+static const char*  TAG = "group";
+static node_group_t group_list[NODE_GROUP_MAX];
+
+static void         node_group_save(void) {
+    esp_err_t err = nvs_set_blob(nvs_handler, "groups", group_list,
+                                 sizeof(group_list));
+    if (err == ESP_OK) err = nvs_commit(nvs_handler);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Save groups failed: %s", esp_err_to_name(err));
+    }
+}
+
+static bool node_group_addr_used(const mesh_addr_t* addr) {
+    for (uint8_t i = 0; i < NODE_GROUP_MAX; i++) {
+        if (group_list[i].name[0] &&
+            memcmp(group_list[i].addr.addr, addr->addr, 6) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* Group address is a mesh group ID (01:00:5E:xx:xx:xx) hashed from its name.
+ * Only 23 bits are left for the hash, a name colliding with an existing
+ * group takes the next free ID. The ID is stored with the group, so it
+ * stays the same once allocated */
+static void node_group_name_to_addr(const char* name, mesh_addr_t* addr) {
+    uint32_t hash = 5381;
+    while (*name) hash = (hash << 5) + hash + (uint8_t)*name++;
+    addr->addr[0] = 0x01;
+    addr->addr[1] = 0x00;
+    addr->addr[2] = 0x5E;
+    do {
+        addr->addr[3] = (hash >> 16) & 0x7F;
+        addr->addr[4] = (hash >> 8) & 0xFF;
+        addr->addr[5] = hash & 0xFF;
+        hash++;
+    } while (node_group_addr_used(addr));
+}
+
+void node_group_init(void) {
+    size_t size = sizeof(group_list);
+    if (nvs_get_blob(nvs_handler, "groups", group_list, &size) != ESP_OK ||
+        size != sizeof(group_list)) {
+        memset(group_list, 0, sizeof(group_list));
+    }
+}
+
+node_group_t* node_group_find(const char* name) {
+    for (uint8_t i = 0; i < NODE_GROUP_MAX; i++) {
+        if (group_list[i].name[0] &&
+            strncmp(group_list[i].name, name, NODE_GROUP_NAME_LEN) == 0)
+            return &group_list[i];
+    }
+    return NULL;
+}
+
+bool node_group_has_member(node_group_t* group, mesh_addr_t* node_addr) {
+    for (uint8_t i = 0; i < group->member_count; i++) {
+        if (memcmp(group->members[i].addr, node_addr->addr, 6) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool node_group_add_member(const char* name, mesh_addr_t* node_addr) {
+    if (strlen(name) == 0 || strlen(name) >= NODE_GROUP_NAME_LEN) return false;
+
+    node_group_t* group = node_group_find(name);
+    if (group == NULL) {
+        for (uint8_t i = 0; i < NODE_GROUP_MAX; i++) {
+            if (!group_list[i].name[0]) {
+                group = &group_list[i];
+                break;
+            }
+        }
+        if (group == NULL) {
+            ESP_LOGW(TAG, "Group table full, cannot create %s", name);
+            return false;
+        }
+        node_group_name_to_addr(name, &group->addr);
+        strcpy(group->name, name);
+        group->member_count = 0;
+    }
+
+    if (node_group_has_member(group, node_addr)) return true;
+    if (group->member_count >= NODE_GROUP_MAX_MEMBERS) {
+        ESP_LOGW(TAG, "Group %s is full", name);
+        return false;
+    }
+    group->members[group->member_count++] = *node_addr;
+    node_group_save();
+    return true;
+}
+
+bool node_group_remove_member(const char* name, mesh_addr_t* node_addr) {
+    node_group_t* group = node_group_find(name);
+    if (group == NULL) return false;
+
+    for (uint8_t i = 0; i < group->member_count; i++) {
+        if (memcmp(group->members[i].addr, node_addr->addr, 6) == 0) {
+            group->members[i] = group->members[--group->member_count];
+            if (group->member_count == 0) memset(group, 0, sizeof(*group));
+            node_group_save();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "esp_mesh.h"
+
+#define NODE_GROUP_MAX         8
+#define NODE_GROUP_NAME_LEN    16
+#define NODE_GROUP_MAX_MEMBERS 64
+
+typedef struct {
+    char        name[NODE_GROUP_NAME_LEN];
+    mesh_addr_t addr;
+    uint8_t     member_count;
+    mesh_addr_t members[NODE_GROUP_MAX_MEMBERS];
+} node_group_t;
+
+/* Load the group table from NVS */
+void          node_group_init(void);
+
+/* Add/remove a node to/from a group, groups are created/deleted on demand */
+bool          node_group_add_member(const char* name, mesh_addr_t* node_addr);
+bool          node_group_remove_member(const char*  name,
+                                       mesh_addr_t* node_addr);
+
+/* Find a group by name, NULL if it does not exist */
+node_group_t* node_group_find(const char* name);
+
+/* Check if a node belongs to a group */
+bool          node_group_has_member(node_group_t* group,
+                                    mesh_addr_t*  node_addr);
@@ -0,0 +1,104 @@
+#include "prov_ledger.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs_flash.h"
+
+extern nvs_handle_t nvs_handler;
+
+typedef struct {
+    uint8_t  mac[6];
+    uint32_t hash;
+} __attribute__((packed)) prov_ledger_entry_t;
+
+static const char*         TAG = "prov_ledger";
+static prov_ledger_entry_t ledger[PROV_LEDGER_MAX_NODES];
+static uint16_t            ledger_count = 0;
+static prov_ledger_entry_t pending[PROV_LEDGER_MAX_PENDING];
+static uint8_t             pending_next = 0;
+static SemaphoreHandle_t   ledger_lock;
+
+void                       prov_ledger_init(void) {
+    ledger_lock = xSemaphoreCreateMutex();
+    size_t size = sizeof(ledger);
+    if (nvs_get_blob(nvs_handler, "prov_ledger", ledger, &size) == ESP_OK) {
+        ledger_count = size / sizeof(prov_ledger_entry_t);
+    }
+    ESP_LOGI(TAG, "%d provisioned nodes in ledger", ledger_count);
+}
+
+/* FNV-1a */
+uint32_t prov_ledger_hash(const char* data) {
+    uint32_t hash = 2166136261u;
+    while (*data) {
+        hash ^= (uint8_t)*data++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static prov_ledger_entry_t* prov_ledger_find(prov_ledger_entry_t* list,
+                                             uint16_t             count,
+                                             const mesh_addr_t*   node_addr) {
+    for (uint16_t i = 0; i < count; i++) {
+        if (memcmp(list[i].mac, node_addr->addr, 6) == 0) return &list[i];
+    }
+    return NULL;
+}
+
+bool prov_ledger_contains(const mesh_addr_t* node_addr, uint32_t hash) {
+    xSemaphoreTake(ledger_lock, portMAX_DELAY);
+    prov_ledger_entry_t* entry =
+        prov_ledger_find(ledger, ledger_count, node_addr);
+    bool found = entry != NULL && entry->hash == hash;
+    xSemaphoreGive(ledger_lock);
+    return found;
+}
+
+void prov_ledger_set_pending(const mesh_addr_t* node_addr, uint32_t hash) {
+    xSemaphoreTake(ledger_lock, portMAX_DELAY);
+    prov_ledger_entry_t* entry =
+        prov_ledger_find(pending, PROV_LEDGER_MAX_PENDING, node_addr);
+    if (entry == NULL) {
+        entry        = &pending[pending_next];
+        pending_next = (pending_next + 1) % PROV_LEDGER_MAX_PENDING;
+        memcpy(entry->mac, node_addr->addr, 6);
+    }
+    entry->hash = hash;
+    xSemaphoreGive(ledger_lock);
+}
+
+void prov_ledger_commit(const mesh_addr_t* node_addr) {
+    xSemaphoreTake(ledger_lock, portMAX_DELAY);
+    prov_ledger_entry_t* pending_entry =
+        prov_ledger_find(pending, PROV_LEDGER_MAX_PENDING, node_addr);
+    if (pending_entry == NULL) {
+        xSemaphoreGive(ledger_lock);
+        return;
+    }
+
+    prov_ledger_entry_t* entry =
+        prov_ledger_find(ledger, ledger_count, node_addr);
+    if (entry == NULL) {
+        if (ledger_count >= PROV_LEDGER_MAX_NODES) {
+            /* Forget the oldest node, it will go through the cloud again */
+            memmove(&ledger[0], &ledger[1],
+                    (ledger_count - 1) * sizeof(prov_ledger_entry_t));
+            ledger_count--;
+        }
+        entry = &ledger[ledger_count++];
+    }
+    *entry = *pending_entry;
+    memset(pending_entry, 0, sizeof(*pending_entry));
+
+    esp_err_t err = nvs_set_blob(nvs_handler, "prov_ledger", ledger,
+                                 ledger_count * sizeof(prov_ledger_entry_t));
+    if (err == ESP_OK) err = nvs_commit(nvs_handler);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Save ledger failed: %s", esp_err_to_name(err));
+    }
+    xSemaphoreGive(ledger_lock);
+}
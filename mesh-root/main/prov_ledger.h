@@ -0,0 +1,20 @@
+#pragma once
+#include "esp_mesh.h"
+
+#define PROV_LEDGER_MAX_NODES   128
+#define PROV_LEDGER_MAX_PENDING 16
+
+/* Load the ledger of provisioned nodes from NVS */
+void     prov_ledger_init(void);
+
+/* Hash of a provisioning document, identifies the node schema */
+uint32_t prov_ledger_hash(const char* data);
+
+/* Check if a node was already provisioned with this schema */
+bool     prov_ledger_contains(const mesh_addr_t* node_addr, uint32_t hash);
+
+/* Remember the schema forwarded to the cloud until it is acknowledged */
+void     prov_ledger_set_pending(const mesh_addr_t* node_addr, uint32_t hash);
+
+/* The cloud acknowledged the node, persist its pending schema */
+void     prov_ledger_commit(const mesh_addr_t* node_addr);
@@ -0,0 +1,202 @@
+#include "publish_queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define ROOT_SOURCE   0
+#define SHARED_SOURCE (PUBLISH_QUEUE_MAX_SOURCES - 1)
+
+typedef struct {
+    publish_msg_t msg;
+    uint8_t       source;
+    uint32_t      seq;
+} publish_entry_t;
+
+typedef struct {
+    bool        in_use;
+    mesh_addr_t addr;
+    uint16_t    count;
+    uint8_t     class_count[TRAFFIC_CLASS_MAX];
+} publish_source_t;
+
+/* One slot array per class, sized by the class publish_queue_depth */
+typedef struct {
+    publish_entry_t* entries;
+    uint8_t          count;
+    uint8_t          next_source; /* Round-robin cursor */
+} publish_class_t;
+
+static const char*           TAG = "publish_queue";
+static publish_class_t       classes[TRAFFIC_CLASS_MAX];
+static publish_source_t      sources[PUBLISH_QUEUE_MAX_SOURCES];
+static publish_queue_stats_t queue_stats;
+static SemaphoreHandle_t     queue_lock;
+static uint32_t              next_seq = 0;
+
+void publish_queue_init(void) {
+    for (traffic_class_t c = 0; c < TRAFFIC_CLASS_MAX; c++) {
+        classes[c].entries = calloc(traffic_class_cfg[c].publish_queue_depth,
+                                    sizeof(publish_entry_t));
+    }
+    sources[ROOT_SOURCE].in_use   = true;
+    sources[SHARED_SOURCE].in_use = true;
+    queue_lock                    = xSemaphoreCreateMutex();
+}
+
+static uint8_t publish_queue_source(const mesh_addr_t* src) {
+    if (src == NULL) return ROOT_SOURCE;
+    uint8_t free_slot = SHARED_SOURCE;
+    for (uint8_t i = ROOT_SOURCE + 1; i < SHARED_SOURCE; i++) {
+        if (!sources[i].in_use) {
+            if (free_slot == SHARED_SOURCE) free_slot = i;
+        } else if (memcmp(sources[i].addr.addr, src->addr, 6) == 0) {
+            return i;
+        }
+    }
+    if (free_slot != SHARED_SOURCE) {
+        sources[free_slot].in_use = true;
+        sources[free_slot].addr   = *src;
+    }
+    return free_slot;
+}
+
+/* Oldest entry of a source in a class, the shared source holds the
+ * messages of several shards */
+static publish_entry_t* publish_queue_oldest(publish_class_t* cls,
+                                             traffic_class_t  traffic_class,
+                                             uint8_t          source,
+                                             uint8_t          shard) {
+    const traffic_class_cfg_t* cfg  = &traffic_class_cfg[traffic_class];
+    publish_entry_t*           best = NULL;
+    for (uint8_t i = 0; i < cfg->publish_queue_depth; i++) {
+        publish_entry_t* entry = &cls->entries[i];
+        if (entry->msg.data == NULL || entry->source != source) continue;
+        if (shard != PUBLISH_QUEUE_ANY_SHARD && entry->msg.shard != shard)
+            continue;
+        if (best == NULL || entry->seq < best->seq) best = entry;
+    }
+    return best;
+}
+
+void publish_msg_free(publish_msg_t* msg) {
+    free(msg->topic);
+    msg_buf_unref(msg->data);
+    msg->topic = NULL;
+    msg->data  = NULL;
+}
+
+static publish_msg_t publish_queue_remove(publish_class_t* cls,
+                                          traffic_class_t  traffic_class,
+                                          publish_entry_t* entry) {
+    publish_source_t* source = &sources[entry->source];
+    publish_msg_t     msg    = entry->msg;
+    entry->msg.data          = NULL;
+    cls->count--;
+    source->class_count[traffic_class]--;
+    if (--source->count == 0 && entry->source != ROOT_SOURCE &&
+        entry->source != SHARED_SOURCE)
+        source->in_use = false;
+    return msg;
+}
+
+bool publish_queue_push(const mesh_addr_t*   src,
+                        const publish_msg_t* msg,
+                        traffic_class_t      traffic_class) {
+    const traffic_class_cfg_t* cfg    = &traffic_class_cfg[traffic_class];
+    publish_class_t*           cls    = &classes[traffic_class];
+    publish_msg_t              victim = {0};
+    bool                       queued = true;
+
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    uint8_t source = publish_queue_source(src);
+    if (cls->count >= cfg->publish_queue_depth) {
+        /* A drop-newest class never gives up queued messages, otherwise the
+         * heaviest source of the class pays for the overflow */
+        if (cfg->drop_policy == TRAFFIC_DROP_NEWEST) {
+            victim = *msg;
+            queued = false;
+        } else {
+            uint8_t heaviest = source;
+            for (uint8_t i = 0; i < PUBLISH_QUEUE_MAX_SOURCES; i++) {
+                if (sources[i].class_count[traffic_class] >
+                    sources[heaviest].class_count[traffic_class])
+                    heaviest = i;
+            }
+            victim = publish_queue_remove(
+                cls, traffic_class,
+                publish_queue_oldest(cls, traffic_class, heaviest,
+                                     PUBLISH_QUEUE_ANY_SHARD));
+        }
+        queue_stats.dropped++;
+    }
+    if (queued) {
+        for (uint8_t i = 0; i < cfg->publish_queue_depth; i++) {
+            publish_entry_t* entry = &cls->entries[i];
+            if (entry->msg.data != NULL) continue;
+            entry->msg    = *msg;
+            entry->source = source;
+            entry->seq    = next_seq++;
+            break;
+        }
+        cls->count++;
+        sources[source].count++;
+        sources[source].class_count[traffic_class]++;
+        queue_stats.queued++;
+    } else if (sources[source].count == 0 && source != ROOT_SOURCE &&
+               source != SHARED_SOURCE) {
+        sources[source].in_use = false;
+    }
+    xSemaphoreGive(queue_lock);
+
+    if (victim.data != NULL) {
+        ESP_LOGW(TAG, "Drop %s message, publish queue full", cfg->name);
+        publish_msg_free(&victim);
+    }
+    return queued;
+}
+
+bool publish_queue_pop(publish_msg_t*   msg,
+                       traffic_class_t* traffic_class,
+                       uint8_t          shard) {
+    bool found = false;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    for (traffic_class_t c = 0; c < TRAFFIC_CLASS_MAX && !found; c++) {
+        publish_class_t* cls = &classes[c];
+        if (cls->count == 0) continue;
+        for (uint8_t n = 0; n < PUBLISH_QUEUE_MAX_SOURCES; n++) {
+            uint8_t s = (cls->next_source + n) % PUBLISH_QUEUE_MAX_SOURCES;
+            if (sources[s].class_count[c] == 0) continue;
+            publish_entry_t* entry = publish_queue_oldest(cls, c, s, shard);
+            if (entry == NULL) continue;
+            cls->next_source = (s + 1) % PUBLISH_QUEUE_MAX_SOURCES;
+            *msg             = publish_queue_remove(cls, c, entry);
+            *traffic_class   = c;
+            found            = true;
+            break;
+        }
+    }
+    xSemaphoreGive(queue_lock);
+    return found;
+}
+
+uint8_t publish_queue_fill(void) {
+    uint32_t queued   = 0;
+    uint32_t capacity = 0;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    for (traffic_class_t c = 0; c < TRAFFIC_CLASS_MAX; c++) {
+        queued += classes[c].count;
+        capacity += traffic_class_cfg[c].publish_queue_depth;
+    }
+    xSemaphoreGive(queue_lock);
+    return queued * 100 / capacity;
+}
+
+void publish_queue_get_stats(publish_queue_stats_t* stats) {
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    *stats = queue_stats;
+    xSemaphoreGive(queue_lock);
+}
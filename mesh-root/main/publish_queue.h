@@ -0,0 +1,50 @@
+#pragma once
+#include "esp_mesh.h"
+#include "msg_buf.h"
+#include "traffic_class.h"
+
+/* Source slots, the first is the root itself and the last one is shared by
+ * the sources that find no free slot */
+#define PUBLISH_QUEUE_MAX_SOURCES 16
+#define PUBLISH_QUEUE_ANY_SHARD   0xFF
+
+/* A message owns its topic and a reference to its data, topic NULL stands
+ * for the up topic. version is the shadow version of a node state message,
+ * 0 otherwise. shard is the MQTT connection it goes out on, the messages of
+ * a source always share one */
+typedef struct {
+    char*      topic;
+    msg_buf_t* data;
+    bool       retain;
+    uint8_t    shard;
+    uint32_t   version;
+} publish_msg_t;
+
+typedef struct {
+    uint32_t queued;
+    uint32_t dropped;
+} publish_queue_stats_t;
+
+void publish_queue_init(void);
+
+/* Queue a message of a source (NULL for the root), the queue takes the
+ * topic and the data reference over. A full drop-oldest class evicts from
+ * its heaviest source, so one chatty node cannot push the others out, a
+ * full drop-newest class rejects msg. False if msg was dropped */
+bool publish_queue_push(const mesh_addr_t*   src,
+                        const publish_msg_t* msg,
+                        traffic_class_t      traffic_class);
+
+/* Next message of a shard in class priority order, sources of a class take
+ * turns. False when there is none, the caller frees the buffers */
+bool publish_queue_pop(publish_msg_t*   msg,
+                       traffic_class_t* traffic_class,
+                       uint8_t          shard);
+
+/* Free the topic and drop the data reference of a message */
+void publish_msg_free(publish_msg_t* msg);
+
+/* Queued messages in percent of the capacity of all classes */
+uint8_t publish_queue_fill(void);
+
+void publish_queue_get_stats(publish_queue_stats_t* stats);
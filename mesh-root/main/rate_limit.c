@@ -0,0 +1,149 @@
+#include "rate_limit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "mesh_root.h"
+
+/* Tokens are kept in thousandths so slow rates refill smoothly */
+#define TOKEN_SCALE 1000
+
+typedef struct {
+    bool        in_use;
+    bool        limited;
+    mesh_addr_t addr;
+    uint32_t    tokens;
+    int64_t     last_us;
+    uint32_t    dropped;
+} rate_limit_bucket_t;
+
+static const char*         TAG = "rate_limit";
+static rate_limit_bucket_t buckets[RATE_LIMIT_MAX_NODES];
+static rate_limit_stats_t  limit_stats;
+static uint32_t            limit_rate  = RATE_LIMIT_RATE;
+static uint32_t            limit_burst = RATE_LIMIT_BURST;
+static portMUX_TYPE        limit_lock  = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t rate_limit_clamp(uint32_t value, uint32_t min, uint32_t max) {
+    if (value < min) return min;
+    if (value > max) return max;
+    return value;
+}
+
+void rate_limit_init(void) {
+    uint32_t value;
+    if (nvs_get_u32(nvs_handler, "rl_rate", &value) == ESP_OK)
+        limit_rate = rate_limit_clamp(value, 0, RATE_LIMIT_MAX_RATE);
+    if (nvs_get_u32(nvs_handler, "rl_burst", &value) == ESP_OK)
+        limit_burst = rate_limit_clamp(value, 1, RATE_LIMIT_MAX_BURST);
+}
+
+/* Caller holds limit_lock. A full table recycles the least recent node,
+ * the newcomer then starts empty so a flood of fresh source addresses
+ * cannot each claim a full burst */
+static rate_limit_bucket_t* rate_limit_get_bucket(const mesh_addr_t* src,
+                                                  int64_t            now) {
+    rate_limit_bucket_t* victim = &buckets[0];
+    for (uint8_t i = 0; i < RATE_LIMIT_MAX_NODES; i++) {
+        rate_limit_bucket_t* bucket = &buckets[i];
+        if (bucket->in_use && memcmp(bucket->addr.addr, src->addr, 6) == 0)
+            return bucket;
+        if (!bucket->in_use) {
+            if (victim->in_use) victim = bucket;
+        } else if (victim->in_use && bucket->last_us < victim->last_us) {
+            victim = bucket;
+        }
+    }
+    bool recycled = victim->in_use;
+    memset(victim, 0, sizeof(*victim));
+    victim->in_use  = true;
+    victim->addr    = *src;
+    victim->tokens  = recycled ? 0 : limit_burst * TOKEN_SCALE;
+    victim->last_us = now;
+    return victim;
+}
+
+bool rate_limit_allow(const mesh_addr_t* src) {
+    if (limit_rate == 0) return true;
+
+    int64_t now = esp_timer_get_time();
+    bool    allowed;
+    bool    first_drop = false;
+    portENTER_CRITICAL(&limit_lock);
+    rate_limit_bucket_t* bucket = rate_limit_get_bucket(src, now);
+    /* Any longer idle time refills the largest bucket at the lowest rate */
+    int64_t elapsed = now - bucket->last_us;
+    if (elapsed > RATE_LIMIT_MAX_BURST * 1000000LL)
+        elapsed = RATE_LIMIT_MAX_BURST * 1000000LL;
+    uint64_t refill = (uint64_t)elapsed * limit_rate * TOKEN_SCALE / 1000000;
+    uint64_t tokens = bucket->tokens + refill;
+    if (tokens > limit_burst * TOKEN_SCALE) tokens = limit_burst * TOKEN_SCALE;
+    /* Keep the remainder of partial tokens for the next message */
+    if (refill) bucket->last_us = now;
+
+    allowed = tokens >= TOKEN_SCALE;
+    if (allowed) {
+        tokens -= TOKEN_SCALE;
+        bucket->limited = false;
+        limit_stats.passed++;
+    } else {
+        first_drop      = !bucket->limited;
+        bucket->limited = true;
+        bucket->dropped++;
+        limit_stats.dropped++;
+    }
+    bucket->tokens = tokens;
+    portEXIT_CRITICAL(&limit_lock);
+
+    if (first_drop) {
+        ESP_LOGW(TAG, MACSTR " exceeds %u messages/s, dropping",
+                 MAC2STR(src->addr), (unsigned)limit_rate);
+    }
+    return allowed;
+}
+
+void rate_limit_configure(uint32_t rate, uint32_t burst) {
+    rate  = rate_limit_clamp(rate, 0, RATE_LIMIT_MAX_RATE);
+    burst = rate_limit_clamp(burst, 1, RATE_LIMIT_MAX_BURST);
+    portENTER_CRITICAL(&limit_lock);
+    limit_rate  = rate;
+    limit_burst = burst;
+    portEXIT_CRITICAL(&limit_lock);
+    nvs_set_u32(nvs_handler, "rl_rate", rate);
+    nvs_set_u32(nvs_handler, "rl_burst", burst);
+    nvs_commit(nvs_handler);
+}
+
+void rate_limit_add_to_json(cJSON* object) {
+    rate_limit_stats_t stats;
+    mesh_addr_t        addrs[RATE_LIMIT_MAX_NODES];
+    uint32_t           dropped[RATE_LIMIT_MAX_NODES];
+    uint8_t            count = 0;
+
+    portENTER_CRITICAL(&limit_lock);
+    stats = limit_stats;
+    for (uint8_t i = 0; i < RATE_LIMIT_MAX_NODES; i++) {
+        if (buckets[i].in_use && buckets[i].dropped) {
+            addrs[count]     = buckets[i].addr;
+            dropped[count++] = buckets[i].dropped;
+        }
+    }
+    portEXIT_CRITICAL(&limit_lock);
+
+    cJSON_AddNumberToObject(object, "rate", limit_rate);
+    cJSON_AddNumberToObject(object, "burst", limit_burst);
+    cJSON_AddNumberToObject(object, "passed", stats.passed);
+    cJSON_AddNumberToObject(object, "dropped", stats.dropped);
+    cJSON* nodes = cJSON_AddArrayToObject(object, "nodes");
+    for (uint8_t i = 0; i < count; i++) {
+        char   id[13];
+        cJSON* item = cJSON_CreateObject();
+        sprintf(id, "%02X%02X%02X%02X%02X%02X", MAC2STR(addrs[i].addr));
+        cJSON_AddStringToObject(item, "id", id);
+        cJSON_AddNumberToObject(item, "dropped", dropped[i]);
+        cJSON_AddItemToArray(nodes, item);
+    }
+}
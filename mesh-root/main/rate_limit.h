@@ -0,0 +1,28 @@
+#pragma once
+#include <cJSON.h>
+
+#include "esp_mesh.h"
+
+#define RATE_LIMIT_MAX_NODES 64
+#define RATE_LIMIT_RATE      10 /* Messages per second and node */
+#define RATE_LIMIT_BURST     30 /* Messages a quiet node may send at once */
+#define RATE_LIMIT_MAX_RATE  10000 /* Keeps the token math within range */
+#define RATE_LIMIT_MAX_BURST 10000
+
+typedef struct {
+    uint32_t passed;
+    uint32_t dropped;
+} rate_limit_stats_t;
+
+/* Load the rate and burst from NVS */
+void rate_limit_init(void);
+
+/* Take a token from the bucket of the source, false to drop the message */
+bool rate_limit_allow(const mesh_addr_t* src);
+
+/* Change the rate (messages/s) and burst, 0 rate disables the limit.
+ * Both are clamped to RATE_LIMIT_MAX_RATE and RATE_LIMIT_MAX_BURST */
+void rate_limit_configure(uint32_t rate, uint32_t burst);
+
+/* Add {"rate","burst","passed","dropped","nodes":[{"id","dropped"}]} */
+void rate_limit_add_to_json(cJSON* object);
@@ -0,0 +1,227 @@
+#include "rtt_probe.h"
+
+#include <cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mesh_root.h"
+#include "topology.h"
+
+#define ID_FMT "%02X%02X%02X%02X%02X%02X"
+
+/* Upper bucket bounds in ms, the last bucket takes everything above */
+static const uint16_t rtt_bounds[] = {2,   5,   10,   20,   30,   50,
+                                      75,  100, 150,  200,  300,  500,
+                                      750, 1000, 1500, 2000, 3000, 5000};
+#define RTT_BUCKETS (sizeof(rtt_bounds) / sizeof(rtt_bounds[0]) + 1)
+
+typedef struct {
+    bool        in_use;
+    mesh_addr_t addr;
+    uint16_t    seq;
+    bool        pending;
+    int64_t     sent_us;
+    uint16_t    samples;
+    uint16_t    lost;
+    uint32_t    max_ms;
+    uint16_t    hist[RTT_BUCKETS];
+} rtt_node_t;
+
+static const char*       TAG = "rtt_probe";
+static rtt_node_t        rtt_nodes[RTT_PROBE_MAX_NODES];
+static mesh_addr_t       root_addr;
+static SemaphoreHandle_t rtt_lock;
+static uint16_t          next_seq   = 0;
+static int               next_index = 0;
+
+static rtt_node_t* rtt_get_node(const mesh_addr_t* node_addr, bool create) {
+    rtt_node_t* free_slot = NULL;
+    for (uint8_t i = 0; i < RTT_PROBE_MAX_NODES; i++) {
+        if (!rtt_nodes[i].in_use) {
+            if (free_slot == NULL) free_slot = &rtt_nodes[i];
+        } else if (memcmp(rtt_nodes[i].addr.addr, node_addr->addr, 6) == 0) {
+            return &rtt_nodes[i];
+        }
+    }
+    if (!create || free_slot == NULL) return NULL;
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->in_use = true;
+    free_slot->addr   = *node_addr;
+    return free_slot;
+}
+
+static void rtt_add_sample(rtt_node_t* node, uint32_t rtt_ms) {
+    uint8_t b = 0;
+    while (b < RTT_BUCKETS - 1 && rtt_ms > rtt_bounds[b]) b++;
+    node->hist[b]++;
+    node->samples++;
+    if (rtt_ms > node->max_ms) node->max_ms = rtt_ms;
+}
+
+/* Upper bound of the bucket holding the percentile, max for the last one */
+static uint32_t rtt_percentile(rtt_node_t* node, uint8_t percent) {
+    uint32_t rank = (node->samples * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (uint8_t b = 0; b < RTT_BUCKETS - 1; b++) {
+        seen += node->hist[b];
+        if (seen >= rank) return rtt_bounds[b];
+    }
+    return node->max_ms;
+}
+
+/* Probe the next node of the routing table, a probe left unanswered
+ * past RTT_PROBE_TIMEOUT_MS counts as lost. The table is sized by the
+ * mesh, not by RTT_PROBE_MAX_NODES. Returns the number of nodes */
+static int rtt_probe_next(void) {
+    int          size          = 0;
+    int          table_size    = esp_mesh_get_routing_table_size();
+    mesh_addr_t* routing_table = malloc(table_size * sizeof(mesh_addr_t));
+    if (routing_table == NULL) return 0;
+    if (esp_mesh_get_routing_table(routing_table,
+                                   table_size * sizeof(mesh_addr_t),
+                                   &size) != ESP_OK ||
+        size <= 1) {
+        free(routing_table);
+        return 0;
+    }
+    if (next_index >= size) next_index = 0;
+    mesh_addr_t target = routing_table[next_index++];
+    if (memcmp(target.addr, root_addr.addr, 6) == 0) {
+        if (next_index >= size) next_index = 0;
+        target = routing_table[next_index++];
+    }
+    free(routing_table);
+    mesh_addr_t* addr = &target;
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(rtt_lock, portMAX_DELAY);
+    rtt_node_t* node = rtt_get_node(addr, true);
+    /* At a fast pace the last probe may still be on its way */
+    if (node == NULL ||
+        (node->pending &&
+         now - node->sent_us < RTT_PROBE_TIMEOUT_MS * 1000LL)) {
+        xSemaphoreGive(rtt_lock);
+        return size - 1;
+    }
+    if (node->pending) node->lost++;
+    node->seq     = next_seq++;
+    node->pending = true;
+    node->sent_us = now;
+    uint16_t seq  = node->seq;
+    xSemaphoreGive(rtt_lock);
+
+    char data[40];
+    sprintf(data, "{\"action\":\"ping\",\"seq\":%u}", seq);
+    send_to_node(*addr, data, TRAFFIC_CLASS_COMMAND);
+    return size - 1;
+}
+
+/* Spread RTT_PROBE_MIN_SAMPLES probes per node over a report window */
+static uint32_t rtt_probe_interval_ms(int nodes) {
+    if (nodes <= 0) return RTT_PROBE_INTERVAL_MS;
+    uint32_t interval = RTT_PROBE_PUBLISH_MS / (nodes * RTT_PROBE_MIN_SAMPLES);
+    if (interval < RTT_PROBE_MIN_INTERVAL_MS) return RTT_PROBE_MIN_INTERVAL_MS;
+    if (interval > RTT_PROBE_INTERVAL_MS) return RTT_PROBE_INTERVAL_MS;
+    return interval;
+}
+
+void rtt_probe_pong(const mesh_addr_t* node_addr, const char* msg) {
+    int64_t now  = esp_timer_get_time();
+    cJSON*  data = cJSON_Parse(msg);
+    cJSON*  seq  = cJSON_GetObjectItem(data, "seq");
+    if (cJSON_IsNumber(seq)) {
+        xSemaphoreTake(rtt_lock, portMAX_DELAY);
+        rtt_node_t* node = rtt_get_node(node_addr, false);
+        /* Late answers of an older probe are ignored */
+        if (node != NULL && node->pending && node->seq == seq->valueint) {
+            node->pending = false;
+            if (now - node->sent_us > RTT_PROBE_TIMEOUT_MS * 1000LL) {
+                node->lost++;
+            } else {
+                rtt_add_sample(node, (now - node->sent_us) / 1000);
+            }
+        }
+        xSemaphoreGive(rtt_lock);
+    }
+    cJSON_Delete(data);
+}
+
+/* {"action":"latency","nodes":[{"id","layer","parent","n","lost","p50",
+ * "p95","p99","max"}]}, the histograms start over after each report */
+static void rtt_publish(void) {
+    cJSON* report = cJSON_CreateObject();
+    cJSON_AddStringToObject(report, "action", "latency");
+    cJSON_AddStringToObject(report, "deviceID", get_mac_addr_str());
+    cJSON* nodes = cJSON_AddArrayToObject(report, "nodes");
+
+    xSemaphoreTake(rtt_lock, portMAX_DELAY);
+    for (uint8_t i = 0; i < RTT_PROBE_MAX_NODES; i++) {
+        rtt_node_t* node = &rtt_nodes[i];
+        if (!node->in_use) continue;
+        char   id[13];
+        cJSON* item = cJSON_CreateObject();
+        sprintf(id, ID_FMT, MAC2STR(node->addr.addr));
+        cJSON_AddStringToObject(item, "id", id);
+
+        mesh_addr_t parent;
+        int         layer;
+        if (topology_get_position(&node->addr, &parent, &layer)) {
+            sprintf(id, ID_FMT, MAC2STR(parent.addr));
+            cJSON_AddNumberToObject(item, "layer", layer);
+            cJSON_AddStringToObject(item, "parent", id);
+        }
+        cJSON_AddNumberToObject(item, "n", node->samples);
+        cJSON_AddNumberToObject(item, "lost", node->lost);
+        if (node->samples) {
+            cJSON_AddNumberToObject(item, "p50", rtt_percentile(node, 50));
+            cJSON_AddNumberToObject(item, "p95", rtt_percentile(node, 95));
+            cJSON_AddNumberToObject(item, "p99", rtt_percentile(node, 99));
+            cJSON_AddNumberToObject(item, "max", node->max_ms);
+        }
+        cJSON_AddItemToArray(nodes, item);
+
+        /* Forget nodes that no longer answer at all */
+        bool idle = node->samples == 0 && !node->pending;
+        memset(node->hist, 0, sizeof(node->hist));
+        node->samples = 0;
+        node->lost    = 0;
+        node->max_ms  = 0;
+        if (idle) node->in_use = false;
+    }
+    xSemaphoreGive(rtt_lock);
+
+    if (cJSON_GetArraySize(nodes)) {
+        char* data = cJSON_PrintUnformatted(report);
+        mqtt_root_publish(data, TRAFFIC_CLASS_LOG);
+        free(data);
+    }
+    cJSON_Delete(report);
+}
+
+static void rtt_probe_task(void* arg) {
+    int64_t next_publish = esp_timer_get_time() + RTT_PROBE_PUBLISH_MS * 1000LL;
+    int     nodes        = 0;
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(rtt_probe_interval_ms(nodes)));
+        nodes = rtt_probe_next();
+        if (esp_timer_get_time() >= next_publish) {
+            rtt_publish();
+            next_publish += RTT_PROBE_PUBLISH_MS * 1000LL;
+        }
+    }
+}
+
+void rtt_probe_init(void) {
+    esp_wifi_get_mac(WIFI_IF_STA, root_addr.addr);
+    rtt_lock = xSemaphoreCreateMutex();
+    xTaskCreate(rtt_probe_task, "rtt_probe", 3072, NULL, 3, NULL);
+    ESP_LOGI(TAG, "Probe %d times per node and report",
+             RTT_PROBE_MIN_SAMPLES);
+}
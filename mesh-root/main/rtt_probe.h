@@ -0,0 +1,20 @@
+#pragma once
+#include "esp_mesh.h"
+
+#define RTT_PROBE_MAX_NODES       64
+#define RTT_PROBE_INTERVAL_MS     2000 /* Slowest pace, few nodes */
+#define RTT_PROBE_MIN_INTERVAL_MS 50   /* Fastest pace, many nodes */
+#define RTT_PROBE_MIN_SAMPLES     100  /* Per node and report, for p99 */
+#define RTT_PROBE_PUBLISH_MS      60000
+#define RTT_PROBE_TIMEOUT_MS      5000
+
+/* Probes are {"action":"ping","seq":n}, nodes answer with "pong" */
+#define RTT_PROBE_PONG_PREFIX "{\"action\":\"pong\""
+
+/* Start probing the nodes of the routing table one after the other, the
+ * pace follows the node count so each gets RTT_PROBE_MIN_SAMPLES per
+ * report while the interval stays above RTT_PROBE_MIN_INTERVAL_MS */
+void rtt_probe_init(void);
+
+/* Handle a pong received from a node */
+void rtt_probe_pong(const mesh_addr_t* node_addr, const char* msg);
@@ -0,0 +1,336 @@
+#include "send_queue.h"
+
+#include <cJSON.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mesh_frag.h"
+
+/* Channel commands wait in the coalescing window as a cJSON object, later
+ * commands to the same destination are merged into it. Given sequence
+ * numbers other than command_seq are sent along in merged_seqs */
+typedef struct {
+    char*           data;
+    cJSON*          channels;
+    uint32_t        command_seq;
+    uint32_t        merged_seqs[SEND_QUEUE_MAX_MERGED];
+    uint8_t         merged_count;
+    traffic_class_t traffic_class;
+    uint32_t        seq;
+    int64_t         not_before_us;
+    int64_t         deadline_us;
+} send_queue_msg_t;
+
+#define SEND_QUEUE_MSG_USED(msg)                                               \
+    ((msg)->data != NULL || (msg)->channels != NULL)
+
+/* One queue per destination so a dead node only stalls its own messages.
+ * Slots are shared by all classes, the next message is the highest class
+ * with the lowest sequence number */
+typedef struct {
+    bool             in_use;
+    mesh_addr_t      addr;
+    uint8_t          count;
+    uint8_t          class_count[TRAFFIC_CLASS_MAX];
+    int64_t          next_try_us;
+    send_queue_msg_t msgs[SEND_QUEUE_DEPTH];
+} send_queue_node_t;
+
+static const char*        TAG = "send_queue";
+static send_queue_node_t  node_queues[SEND_QUEUE_MAX_NODES];
+static send_queue_stats_t queue_stats;
+static SemaphoreHandle_t  queue_lock;
+static TaskHandle_t       sender_task;
+static uint32_t           next_seq = 0;
+static uint32_t           next_command_seq;
+
+static send_queue_node_t* send_queue_get_node(mesh_addr_t* node_addr,
+                                              bool         create) {
+    send_queue_node_t* free_slot = NULL;
+    for (uint8_t i = 0; i < SEND_QUEUE_MAX_NODES; i++) {
+        if (!node_queues[i].in_use) {
+            if (free_slot == NULL) free_slot = &node_queues[i];
+        } else if (memcmp(node_queues[i].addr.addr, node_addr->addr, 6) == 0) {
+            return &node_queues[i];
+        }
+    }
+    if (create && free_slot != NULL) {
+        memset(free_slot, 0, sizeof(*free_slot));
+        free_slot->in_use = true;
+        free_slot->addr   = *node_addr;
+    }
+    return create ? free_slot : NULL;
+}
+
+/* Oldest message of a class, or of the highest class if traffic_class is
+ * TRAFFIC_CLASS_MAX */
+static send_queue_msg_t* send_queue_oldest(send_queue_node_t* node,
+                                           traffic_class_t    traffic_class) {
+    send_queue_msg_t* best = NULL;
+    for (uint8_t i = 0; i < SEND_QUEUE_DEPTH; i++) {
+        send_queue_msg_t* msg = &node->msgs[i];
+        if (!SEND_QUEUE_MSG_USED(msg)) continue;
+        if (traffic_class != TRAFFIC_CLASS_MAX &&
+            msg->traffic_class != traffic_class)
+            continue;
+        if (best == NULL || msg->traffic_class < best->traffic_class ||
+            (msg->traffic_class == best->traffic_class && msg->seq < best->seq))
+            best = msg;
+    }
+    return best;
+}
+
+static void send_queue_remove(send_queue_node_t* node, send_queue_msg_t* msg) {
+    free(msg->data);
+    cJSON_Delete(msg->channels);
+    msg->data     = NULL;
+    msg->channels = NULL;
+    node->class_count[msg->traffic_class]--;
+    node->count--;
+    node->next_try_us = 0;
+}
+
+/* {"action":"command","seq":n,"merged":[m,...],"channels":{...}}, the node
+ * acknowledges seq and ignores seq or any merged one if it comes again */
+static char* send_queue_render_command(send_queue_msg_t* msg) {
+    char* channels = cJSON_PrintUnformatted(msg->channels);
+    if (channels == NULL) return NULL;
+    char* data = malloc(strlen(channels) + 80 + msg->merged_count * 11);
+    if (data != NULL) {
+        int len = sprintf(data, "{\"action\":\"command\",\"seq\":%u,",
+                          (unsigned)msg->command_seq);
+        for (uint8_t i = 0; i < msg->merged_count; i++) {
+            len += sprintf(data + len, "%s%u%s", i ? "" : "\"merged\":[",
+                           (unsigned)msg->merged_seqs[i],
+                           i + 1 < msg->merged_count ? "," : "],");
+        }
+        sprintf(data + len, "\"channels\":%s}", channels);
+    }
+    free(channels);
+    return data;
+}
+
+/* True if the command of seq can ride along in msg, a given sequence
+ * number is added to the merged list of the frame */
+static bool send_queue_merge_seq(send_queue_msg_t* msg, uint32_t seq) {
+    if (seq == 0 || seq == msg->command_seq) return true;
+    for (uint8_t i = 0; i < msg->merged_count; i++) {
+        if (msg->merged_seqs[i] == seq) return true;
+    }
+    if (msg->merged_count == SEND_QUEUE_MAX_MERGED) return false;
+    msg->merged_seqs[msg->merged_count++] = seq;
+    return true;
+}
+
+/* Try the next message of one destination, returns when it is due again */
+static int64_t send_queue_service_node(send_queue_node_t* node, int64_t now) {
+    while (node->count) {
+        send_queue_msg_t* msg = send_queue_oldest(node, TRAFFIC_CLASS_MAX);
+        if (now >= msg->deadline_us) {
+            ESP_LOGW(TAG, "Drop expired %s message to " MACSTR "",
+                     traffic_class_cfg[msg->traffic_class].name,
+                     MAC2STR(node->addr.addr));
+            queue_stats.expired++;
+            send_queue_remove(node, msg);
+            continue;
+        }
+        if (now < node->next_try_us) return node->next_try_us;
+        if (now < msg->not_before_us) return msg->not_before_us;
+
+        /* The window is over, the merged command is final */
+        if (msg->channels != NULL) {
+            msg->data = send_queue_render_command(msg);
+            cJSON_Delete(msg->channels);
+            msg->channels = NULL;
+            if (msg->data == NULL) {
+                send_queue_remove(node, msg);
+                continue;
+            }
+        }
+
+        esp_err_t err = mesh_frag_send(
+            &node->addr, msg->data, strlen(msg->data),
+            traffic_class_cfg[msg->traffic_class].mesh_tos,
+            MESH_DATA_FROMDS | MESH_DATA_NONBLOCK |
+                traffic_class_cfg[msg->traffic_class].mesh_flag);
+        if (err == ESP_OK) {
+            queue_stats.sent++;
+            send_queue_remove(node, msg);
+            continue;
+        }
+
+        /* Queue full, no route or timeout: retry this node later only */
+        queue_stats.retried++;
+        node->next_try_us = now + SEND_QUEUE_RETRY_MS * 1000;
+        return node->next_try_us;
+    }
+    node->in_use = false;
+    return INT64_MAX;
+}
+
+static void send_queue_task(void* arg) {
+    for (;;) {
+        int64_t now      = esp_timer_get_time();
+        int64_t next_due = INT64_MAX;
+
+        xSemaphoreTake(queue_lock, portMAX_DELAY);
+        for (uint8_t i = 0; i < SEND_QUEUE_MAX_NODES; i++) {
+            if (!node_queues[i].in_use) continue;
+            int64_t due = send_queue_service_node(&node_queues[i], now);
+            if (due < next_due) next_due = due;
+        }
+        xSemaphoreGive(queue_lock);
+
+        TickType_t wait = portMAX_DELAY;
+        if (next_due != INT64_MAX) {
+            wait = pdMS_TO_TICKS((next_due - now) / 1000);
+            if (wait == 0) wait = 1;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+void send_queue_init(void) {
+    /* Nodes remember recent sequence numbers across a root reboot */
+    next_command_seq = esp_random();
+    queue_lock       = xSemaphoreCreateMutex();
+    xTaskCreate(send_queue_task, "send_queue", 4096, NULL, 5, &sender_task);
+}
+
+/* Make room for a new message according to the class drop policy */
+static bool send_queue_make_room(send_queue_node_t* node,
+                                 traffic_class_t    traffic_class) {
+    const traffic_class_cfg_t* cfg    = &traffic_class_cfg[traffic_class];
+    send_queue_msg_t*          victim = NULL;
+
+    if (node->class_count[traffic_class] < cfg->node_queue_depth &&
+        node->count < SEND_QUEUE_DEPTH)
+        return true;
+
+    /* A full destination first gives up its lowest class messages */
+    if (node->class_count[traffic_class] < cfg->node_queue_depth) {
+        for (int c = TRAFFIC_CLASS_MAX - 1; c > traffic_class; c--) {
+            if (node->class_count[c]) {
+                victim = send_queue_oldest(node, c);
+                break;
+            }
+        }
+    }
+    if (victim == NULL && cfg->drop_policy == TRAFFIC_DROP_OLDEST) {
+        victim = send_queue_oldest(node, traffic_class);
+    }
+    if (victim == NULL) return false;
+
+    queue_stats.evicted++;
+    send_queue_remove(node, victim);
+    return true;
+}
+
+/* Caller holds queue_lock, exactly one of data and channels is set */
+static esp_err_t send_queue_add(mesh_addr_t*    node_addr,
+                                const char*     data,
+                                cJSON*          channels,
+                                uint32_t*       command_seq,
+                                traffic_class_t traffic_class) {
+    send_queue_node_t* node = send_queue_get_node(node_addr, true);
+    if (node == NULL) {
+        queue_stats.rejected++;
+        return ESP_ERR_MESH_QUEUE_FULL;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (channels != NULL) {
+        /* Merge into a command still waiting in its window, the last value
+         * of a channel wins. The frame is acknowledged with its own
+         * sequence number, which is returned for every merged command */
+        for (uint8_t i = 0; i < SEND_QUEUE_DEPTH; i++) {
+            send_queue_msg_t* msg = &node->msgs[i];
+            if (msg->channels == NULL) continue;
+            if (!send_queue_merge_seq(msg, *command_seq)) continue;
+            cJSON* item;
+            cJSON_ArrayForEach(item, channels) {
+                cJSON* copy = cJSON_Duplicate(item, 1);
+                if (cJSON_HasObjectItem(msg->channels, item->string)) {
+                    cJSON_ReplaceItemInObject(msg->channels, item->string,
+                                              copy);
+                } else {
+                    cJSON_AddItemToObject(msg->channels, item->string, copy);
+                }
+            }
+            msg->deadline_us = now + SEND_QUEUE_TIMEOUT_MS * 1000LL;
+            *command_seq     = msg->command_seq;
+            queue_stats.coalesced++;
+            return ESP_OK;
+        }
+    }
+
+    esp_err_t err = ESP_OK;
+    if (!send_queue_make_room(node, traffic_class)) {
+        queue_stats.rejected++;
+        err = ESP_ERR_MESH_QUEUE_FULL;
+    } else {
+        send_queue_msg_t* msg = NULL;
+        for (uint8_t i = 0; i < SEND_QUEUE_DEPTH; i++) {
+            if (!SEND_QUEUE_MSG_USED(&node->msgs[i])) {
+                msg = &node->msgs[i];
+                break;
+            }
+        }
+        if (channels != NULL) {
+            msg->channels      = cJSON_Duplicate(channels, 1);
+            if (*command_seq == 0) *command_seq = next_command_seq++;
+            msg->command_seq   = *command_seq;
+            msg->merged_count  = 0;
+            msg->not_before_us = now + SEND_QUEUE_COALESCE_MS * 1000LL;
+        } else {
+            msg->data          = strdup(data);
+            msg->not_before_us = 0;
+        }
+        if (!SEND_QUEUE_MSG_USED(msg)) {
+            err = ESP_ERR_NO_MEM;
+        } else {
+            msg->traffic_class = traffic_class;
+            msg->seq           = next_seq++;
+            msg->deadline_us   = now + SEND_QUEUE_TIMEOUT_MS * 1000LL;
+            node->class_count[traffic_class]++;
+            node->count++;
+        }
+    }
+    if (node->count == 0) node->in_use = false;
+    return err;
+}
+
+esp_err_t send_queue_push(mesh_addr_t*    node_addr,
+                          const char*     data,
+                          traffic_class_t traffic_class) {
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    esp_err_t err = send_queue_add(node_addr, data, NULL, NULL, traffic_class);
+    xSemaphoreGive(queue_lock);
+
+    if (err == ESP_OK) xTaskNotifyGive(sender_task);
+    return err;
+}
+
+esp_err_t send_queue_push_channels(mesh_addr_t* node_addr,
+                                   cJSON*       channels,
+                                   uint32_t*    command_seq) {
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    esp_err_t err = send_queue_add(node_addr, NULL, channels, command_seq,
+                                   TRAFFIC_CLASS_COMMAND);
+    xSemaphoreGive(queue_lock);
+
+    if (err == ESP_OK) xTaskNotifyGive(sender_task);
+    return err;
+}
+
+void send_queue_get_stats(send_queue_stats_t* stats) {
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    *stats = queue_stats;
+    xSemaphoreGive(queue_lock);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cJSON.h>
+
+#include "esp_mesh.h"
+#include "traffic_class.h"
+
+#define SEND_QUEUE_MAX_NODES   32
+#define SEND_QUEUE_DEPTH       12
+#define SEND_QUEUE_RETRY_MS    50
+#define SEND_QUEUE_TIMEOUT_MS  5000
+#define SEND_QUEUE_COALESCE_MS 30
+#define SEND_QUEUE_MAX_MERGED  4 /* Given seqs per frame, within the node LRU */
+
+typedef struct {
+    uint32_t sent;
+    uint32_t retried;
+    uint32_t expired;
+    uint32_t rejected;
+    uint32_t evicted;
+    uint32_t coalesced;
+} send_queue_stats_t;
+
+/* Create the per-destination queues and the sender task */
+void      send_queue_init(void);
+
+/* Copy data into the destination queue, never blocks on the mesh.
+ * Higher traffic classes of a destination are always sent first */
+esp_err_t send_queue_push(mesh_addr_t*    node_addr,
+                          const char*     data,
+                          traffic_class_t traffic_class);
+
+/* Queue a {"<channel>":value,...} command. A non zero command_seq is
+ * used as is so a retried cloud command keeps its number, with 0 one is
+ * assigned. Commands to the same destination arriving within
+ * SEND_QUEUE_COALESCE_MS are merged into one frame, up to
+ * SEND_QUEUE_MAX_MERGED other given numbers travel along so the node
+ * deduplicates their retries. command_seq returns the number the frame
+ * is acknowledged with */
+esp_err_t send_queue_push_channels(mesh_addr_t* node_addr,
+                                   cJSON*       channels,
+                                   uint32_t*    command_seq);
+
+void      send_queue_get_stats(send_queue_stats_t* stats);
@@ -0,0 +1,65 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "device_shadow.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mesh_root.h"
+#include "nvs_flash.h"
+
+static const char*  TAG         = "snapshot";
+static uint32_t     interval_ms = SNAPSHOT_INTERVAL_MS;
+static uint32_t     seq         = 0;
+static TaskHandle_t snapshot_task_handle;
+
+/* One document with every node, built from the shadow at a fixed cost */
+static void snapshot_publish(void) {
+    char   prefix[96];
+    size_t len;
+    snprintf(prefix, sizeof(prefix),
+             "{\"action\":\"snapshot\",\"deviceID\":\"%s\",\"seq\":%u,"
+             "\"nodes\":",
+             get_mac_addr_str(), (unsigned)seq++);
+    char* data = device_shadow_print_all(prefix, "}", &len);
+    if (data == NULL) {
+        ESP_LOGW(TAG, "No memory for the snapshot");
+        return;
+    }
+    mqtt_root_publish(data, TRAFFIC_CLASS_TELEMETRY);
+    free(data);
+}
+
+static void snapshot_task(void* arg) {
+    for (;;) {
+        TickType_t wait = interval_ms ? pdMS_TO_TICKS(interval_ms)
+                                      : portMAX_DELAY;
+        /* A notification means the interval changed, start over */
+        if (ulTaskNotifyTake(pdTRUE, wait) == 0 && interval_ms) {
+            snapshot_publish();
+        }
+    }
+}
+
+void snapshot_init(void) {
+    uint32_t stored;
+    if (nvs_get_u32(nvs_handler, "snap_interval", &stored) == ESP_OK) {
+        interval_ms = stored;
+    }
+    xTaskCreate(snapshot_task, "snapshot", 3072, NULL, 3,
+                &snapshot_task_handle);
+}
+
+void snapshot_set_interval(uint32_t new_interval_ms) {
+    if (new_interval_ms && new_interval_ms < SNAPSHOT_MIN_INTERVAL_MS) {
+        new_interval_ms = SNAPSHOT_MIN_INTERVAL_MS;
+    }
+    interval_ms = new_interval_ms;
+    nvs_set_u32(nvs_handler, "snap_interval", interval_ms);
+    nvs_commit(nvs_handler);
+    xTaskNotifyGive(snapshot_task_handle);
+}
+
+uint32_t snapshot_get_interval(void) { return interval_ms; }
@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+
+/* Default snapshot period, 0 disables the snapshots */
+#define SNAPSHOT_INTERVAL_MS     60000
+#define SNAPSHOT_MIN_INTERVAL_MS 5000
+
+/* Start the periodic publication of the whole network state */
+void     snapshot_init(void);
+
+/* Change the period at run time, it is kept in NVS */
+void     snapshot_set_interval(uint32_t interval_ms);
+uint32_t snapshot_get_interval(void);
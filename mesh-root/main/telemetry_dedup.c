@@ -0,0 +1,92 @@
+#include "telemetry_dedup.h"
+
+#include <string.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "mesh_root.h"
+
+typedef struct {
+    bool        in_use;
+    mesh_addr_t addr;
+    uint32_t    hash;
+    uint32_t    len;
+    int64_t     forwarded_us;
+} telemetry_dedup_entry_t;
+
+static telemetry_dedup_entry_t dedup_list[TELEMETRY_DEDUP_MAX_NODES];
+static uint32_t                dedup_interval_ms = TELEMETRY_DEDUP_INTERVAL_MS;
+static uint32_t                forwarded         = 0;
+static uint32_t                suppressed        = 0;
+static portMUX_TYPE            dedup_lock        = portMUX_INITIALIZER_UNLOCKED;
+
+void telemetry_dedup_init(void) {
+    uint32_t value;
+    if (nvs_get_u32(nvs_handler, "dedup_interval", &value) == ESP_OK)
+        dedup_interval_ms = value;
+}
+
+/* FNV-1a, the length is compared as well */
+static uint32_t telemetry_dedup_hash(const char* data, uint32_t* len) {
+    const char* start = data;
+    uint32_t    hash  = 2166136261u;
+    while (*data) {
+        hash ^= (uint8_t)*data++;
+        hash *= 16777619u;
+    }
+    *len = data - start;
+    return hash;
+}
+
+bool telemetry_dedup_check(const mesh_addr_t* src, const char* data) {
+    uint32_t len;
+    uint32_t hash = telemetry_dedup_hash(data, &len);
+    int64_t  now  = esp_timer_get_time();
+    bool     forward;
+
+    portENTER_CRITICAL(&dedup_lock);
+    /* Unknown nodes take a free slot or the one forwarded longest ago */
+    telemetry_dedup_entry_t* entry  = NULL;
+    telemetry_dedup_entry_t* victim = NULL;
+    for (uint8_t i = 0; i < TELEMETRY_DEDUP_MAX_NODES && entry == NULL; i++) {
+        telemetry_dedup_entry_t* e = &dedup_list[i];
+        if (!e->in_use) {
+            if (victim == NULL || victim->in_use) victim = e;
+        } else if (memcmp(e->addr.addr, src->addr, 6) == 0) {
+            entry = e;
+        } else if (victim == NULL ||
+                   (victim->in_use && e->forwarded_us < victim->forwarded_us)) {
+            victim = e;
+        }
+    }
+    forward = entry == NULL || dedup_interval_ms == 0 || entry->hash != hash ||
+              entry->len != len ||
+              now - entry->forwarded_us >= dedup_interval_ms * 1000LL;
+    if (forward) {
+        if (entry == NULL) {
+            entry         = victim;
+            entry->in_use = true;
+            entry->addr   = *src;
+        }
+        entry->hash         = hash;
+        entry->len          = len;
+        entry->forwarded_us = now;
+        forwarded++;
+    } else {
+        suppressed++;
+    }
+    portEXIT_CRITICAL(&dedup_lock);
+    return forward;
+}
+
+void telemetry_dedup_set_interval(uint32_t interval_ms) {
+    dedup_interval_ms = interval_ms;
+    nvs_set_u32(nvs_handler, "dedup_interval", interval_ms);
+    nvs_commit(nvs_handler);
+}
+
+void telemetry_dedup_add_to_json(cJSON* object) {
+    cJSON_AddNumberToObject(object, "interval_ms", dedup_interval_ms);
+    cJSON_AddNumberToObject(object, "forwarded", forwarded);
+    cJSON_AddNumberToObject(object, "suppressed", suppressed);
+}
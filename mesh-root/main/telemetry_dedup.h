@@ -0,0 +1,21 @@
+#pragma once
+#include <cJSON.h>
+
+#include "esp_mesh.h"
+
+#define TELEMETRY_DEDUP_MAX_NODES   64
+/* An unchanged frame is still forwarded once per interval as a heartbeat */
+#define TELEMETRY_DEDUP_INTERVAL_MS 300000
+
+/* Load the interval from NVS */
+void telemetry_dedup_init(void);
+
+/* False if the frame is byte-identical to the last one forwarded for the
+ * node within the interval */
+bool telemetry_dedup_check(const mesh_addr_t* src, const char* data);
+
+/* Change the interval, 0 forwards every frame */
+void telemetry_dedup_set_interval(uint32_t interval_ms);
+
+/* Add {"interval_ms","forwarded","suppressed"} */
+void telemetry_dedup_add_to_json(cJSON* object);
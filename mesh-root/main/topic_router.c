@@ -0,0 +1,133 @@
+#include "topic_router.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/* One trie node per topic level, siblings are chained */
+typedef struct topic_node_t {
+    struct topic_node_t* next;
+    struct topic_node_t* children;
+    char*                level;
+    topic_handler_t      handler;
+} topic_node_t;
+
+static const char*       TAG = "topic_router";
+static topic_node_t      root_node;
+static char*             patterns[TOPIC_ROUTER_MAX_ROUTES];
+static int               pattern_count = 0;
+static SemaphoreHandle_t router_lock;
+
+static topic_node_t* topic_router_child(topic_node_t* parent,
+                                        const char*   level,
+                                        int           level_len,
+                                        bool          create) {
+    for (topic_node_t* child = parent->children; child; child = child->next) {
+        if ((int)strlen(child->level) == level_len &&
+            strncmp(child->level, level, level_len) == 0)
+            return child;
+    }
+    if (!create) return NULL;
+
+    topic_node_t* child = calloc(1, sizeof(topic_node_t));
+    child->level        = strndup(level, level_len);
+    child->next         = parent->children;
+    parent->children    = child;
+    return child;
+}
+
+void topic_router_init(void) { router_lock = xSemaphoreCreateMutex(); }
+
+bool topic_router_add(const char* pattern, topic_handler_t handler) {
+    xSemaphoreTake(router_lock, portMAX_DELAY);
+    if (pattern_count >= TOPIC_ROUTER_MAX_ROUTES) {
+        xSemaphoreGive(router_lock);
+        ESP_LOGW(TAG, "Route table full, %s is not added", pattern);
+        return false;
+    }
+
+    topic_node_t* node  = &root_node;
+    const char*   level = pattern;
+    for (;;) {
+        const char* end = strchr(level, '/');
+        int         len = end ? end - level : strlen(level);
+        node            = topic_router_child(node, level, len, true);
+        if (end == NULL) break;
+        level = end + 1;
+    }
+    node->handler             = handler;
+    patterns[pattern_count++] = strdup(pattern);
+    xSemaphoreGive(router_lock);
+    return true;
+}
+
+/* Exact levels are tried before '+', and '+' before '#' */
+static topic_node_t* topic_router_match(topic_node_t*  node,
+                                        const char*    level,
+                                        const char*    topic_end,
+                                        topic_match_t* match) {
+    const char* end = memchr(level, '/', topic_end - level);
+    int         len = end ? end - level : topic_end - level;
+
+    topic_node_t* child = topic_router_child(node, level, len, false);
+    topic_node_t* found = NULL;
+    if (child != NULL) {
+        found = end ? topic_router_match(child, end + 1, topic_end, match)
+                    : child;
+        if (found != NULL && found->handler != NULL) return found;
+    }
+
+    child = topic_router_child(node, "+", 1, false);
+    if (child != NULL) {
+        found = end ? topic_router_match(child, end + 1, topic_end, match)
+                    : child;
+        if (found != NULL && found->handler != NULL) {
+            match->wildcard     = level;
+            match->wildcard_len = len;
+            return found;
+        }
+    }
+
+    return topic_router_child(node, "#", 1, false);
+}
+
+bool topic_router_dispatch(const char* topic,
+                           int         topic_len,
+                           const char* data,
+                           int         data_len) {
+    topic_match_t match = {.topic        = topic,
+                           .topic_len    = topic_len,
+                           .wildcard     = NULL,
+                           .wildcard_len = 0};
+
+    /* Nodes are never freed, the handler runs without the lock */
+    xSemaphoreTake(router_lock, portMAX_DELAY);
+    topic_node_t* node =
+        topic_router_match(&root_node, topic, topic + topic_len, &match);
+    topic_handler_t handler = node ? node->handler : NULL;
+    xSemaphoreGive(router_lock);
+    if (handler == NULL) {
+        ESP_LOGW(TAG, "No route for %.*s", topic_len, topic);
+        return false;
+    }
+    handler(&match, data, data_len);
+    return true;
+}
+
+int topic_router_count(void) {
+    xSemaphoreTake(router_lock, portMAX_DELAY);
+    int count = pattern_count;
+    xSemaphoreGive(router_lock);
+    return count;
+}
+
+/* Patterns are only appended, the pointer stays valid */
+const char* topic_router_pattern(int index) {
+    xSemaphoreTake(router_lock, portMAX_DELAY);
+    const char* pattern = patterns[index];
+    xSemaphoreGive(router_lock);
+    return pattern;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdbool.h>
+
+#define TOPIC_ROUTER_MAX_ROUTES 16
+
+typedef struct {
+    const char* topic;        /* Not terminated */
+    int         topic_len;
+    const char* wildcard;     /* Level matched by the first '+', or NULL */
+    int         wildcard_len;
+} topic_match_t;
+
+typedef void (*topic_handler_t)(const topic_match_t* match,
+                                const char*          data,
+                                int                  data_len);
+
+/* Create the lock, routes may be added while messages are dispatched */
+void        topic_router_init(void);
+
+/* Map a subscription pattern ('+' and '#' wildcards) to a handler */
+bool        topic_router_add(const char* pattern, topic_handler_t handler);
+
+/* Walk the pattern trie, false if no route matches the topic */
+bool        topic_router_dispatch(const char* topic,
+                                  int         topic_len,
+                                  const char* data,
+                                  int         data_len);
+
+/* Registered patterns, to subscribe them on (re)connect */
+int         topic_router_count(void);
+const char* topic_router_pattern(int index);
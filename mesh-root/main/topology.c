@@ -0,0 +1,245 @@
+#include "topology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mesh_root.h"
+
+/* Live state and the state last published, a diff is the difference */
+typedef struct {
+    bool        in_use;
+    bool        present;
+    bool        published;
+    mesh_addr_t addr;
+    mesh_addr_t parent;
+    int8_t      layer;
+    mesh_addr_t published_parent;
+    int8_t      published_layer;
+} topology_node_t;
+
+static const char*       TAG = "topology";
+static topology_node_t   topology_nodes[TOPOLOGY_MAX_NODES];
+static mesh_addr_t       root_addr;
+static SemaphoreHandle_t topology_lock;
+static TaskHandle_t      topology_task_handle;
+static bool              routing_dirty  = true;
+static bool              full_requested = true;
+static uint32_t          seq            = 0;
+
+static topology_node_t* topology_get_node(const uint8_t* mac, bool create) {
+    topology_node_t* free_slot = NULL;
+    for (uint8_t i = 0; i < TOPOLOGY_MAX_NODES; i++) {
+        if (!topology_nodes[i].in_use) {
+            if (free_slot == NULL) free_slot = &topology_nodes[i];
+        } else if (memcmp(topology_nodes[i].addr.addr, mac, 6) == 0) {
+            return &topology_nodes[i];
+        }
+    }
+    if (!create) return NULL;
+    if (free_slot == NULL) {
+        ESP_LOGW(TAG, "Topology table full, " MACSTR " is not tracked",
+                 MAC2STR(mac));
+        return NULL;
+    }
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->in_use          = true;
+    free_slot->published_layer = -1;
+    free_slot->layer           = -1;
+    memcpy(free_slot->addr.addr, mac, 6);
+    return free_slot;
+}
+
+/* The table is sized by the mesh, not by TOPOLOGY_MAX_NODES, nodes past
+ * that are only logged. Caller holds topology_lock */
+static void topology_read_routing_table(void) {
+    int          size          = 0;
+    int          table_size    = esp_mesh_get_routing_table_size();
+    mesh_addr_t* routing_table = malloc(table_size * sizeof(mesh_addr_t));
+    if (routing_table == NULL) return;
+    if (esp_mesh_get_routing_table(routing_table,
+                                   table_size * sizeof(mesh_addr_t),
+                                   &size) != ESP_OK) {
+        free(routing_table);
+        return;
+    }
+
+    for (uint8_t i = 0; i < TOPOLOGY_MAX_NODES; i++) {
+        topology_nodes[i].present = false;
+    }
+    for (int i = 0; i < size; i++) {
+        if (memcmp(routing_table[i].addr, root_addr.addr, 6) == 0) continue;
+        topology_node_t* node = topology_get_node(routing_table[i].addr, true);
+        if (node != NULL) node->present = true;
+    }
+    free(routing_table);
+    routing_dirty = false;
+}
+
+static bool topology_changed(topology_node_t* node) {
+    return node->present != node->published ||
+           (node->present &&
+            (node->layer != node->published_layer ||
+             memcmp(node->parent.addr, node->published_parent.addr, 6) != 0));
+}
+
+/* Node IDs use the deviceID format of the rest of the messages */
+#define ID_FMT "%02X%02X%02X%02X%02X%02X"
+#define TOPOLOGY_HEADER_SIZE 160
+#define TOPOLOGY_ITEM_SIZE   64
+#define TOPOLOGY_DOC_SIZE                                                      \
+    (TOPOLOGY_HEADER_SIZE + TOPOLOGY_MAX_NODES * TOPOLOGY_ITEM_SIZE)
+
+/* Build {"action":"topology",...,"nodes":[...],"removed":[...]}, NULL if
+ * nothing changed. Caller holds topology_lock */
+static char* topology_build(bool full) {
+    int     count = 0;
+    int     depth = 0;
+    int     diffs = 0;
+    for (uint8_t i = 0; i < TOPOLOGY_MAX_NODES; i++) {
+        topology_node_t* node = &topology_nodes[i];
+        if (!node->in_use) continue;
+        if (node->present) {
+            count++;
+            if (node->layer > depth) depth = node->layer;
+        }
+        if (topology_changed(node)) diffs++;
+    }
+    if (!full && diffs == 0) return NULL;
+
+    char* out = malloc(TOPOLOGY_DOC_SIZE);
+    if (out == NULL) return NULL;
+    char* pos = out;
+    pos += sprintf(pos,
+                   "{\"action\":\"topology\",\"deviceID\":\"%s\",\"seq\":%u,"
+                   "\"full\":%s,\"size\":%d,\"depth\":%d,\"nodes\":[",
+                   get_mac_addr_str(), (unsigned)seq++,
+                   full ? "true" : "false", count, depth);
+    for (uint8_t i = 0; i < TOPOLOGY_MAX_NODES; i++) {
+        topology_node_t* node = &topology_nodes[i];
+        if (!node->in_use || !node->present) continue;
+        if (!full && !topology_changed(node)) continue;
+        if (pos[-1] == '}') *pos++ = ',';
+        pos += sprintf(pos, "{\"id\":\"" ID_FMT "\"", MAC2STR(node->addr.addr));
+        if (node->layer > 0) {
+            /* Not known until the node reports it */
+            pos += sprintf(pos, ",\"parent\":\"" ID_FMT "\",\"layer\":%d",
+                           MAC2STR(node->parent.addr), node->layer);
+        }
+        *pos++ = '}';
+    }
+    pos += sprintf(pos, "],\"removed\":[");
+    for (uint8_t i = 0; i < TOPOLOGY_MAX_NODES; i++) {
+        topology_node_t* node = &topology_nodes[i];
+        if (!node->in_use || node->present || !node->published) continue;
+        if (pos[-1] == '"') *pos++ = ',';
+        pos += sprintf(pos, "\"" ID_FMT "\"", MAC2STR(node->addr.addr));
+    }
+    strcpy(pos, "]}");
+    return out;
+}
+
+/* The published state becomes the reference of the next diff */
+static void topology_commit(void) {
+    for (uint8_t i = 0; i < TOPOLOGY_MAX_NODES; i++) {
+        topology_node_t* node = &topology_nodes[i];
+        if (!node->in_use) continue;
+        node->published        = node->present;
+        node->published_layer  = node->layer;
+        node->published_parent = node->parent;
+        /* Forget nodes that left, they are re-created when they come back */
+        if (!node->present) node->in_use = false;
+    }
+}
+
+static void topology_task(void* arg) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        /* Let a burst of events (a subtree moving) settle into one diff */
+        while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TOPOLOGY_SETTLE_MS))) {
+        }
+
+        xSemaphoreTake(topology_lock, portMAX_DELAY);
+        if (routing_dirty) topology_read_routing_table();
+        bool  full = full_requested;
+        char* data = topology_build(full);
+        if (data != NULL) {
+            topology_commit();
+            full_requested = false;
+        }
+        xSemaphoreGive(topology_lock);
+
+        if (data != NULL) {
+            mqtt_root_publish(data, TRAFFIC_CLASS_LOG);
+            free(data);
+        }
+    }
+}
+
+void topology_init(void) {
+    esp_wifi_get_mac(WIFI_IF_STA, root_addr.addr);
+    topology_lock = xSemaphoreCreateMutex();
+    xTaskCreate(topology_task, "topology", 3072, NULL, 3,
+                &topology_task_handle);
+}
+
+void topology_routing_changed(void) {
+    routing_dirty = true;
+    xTaskNotifyGive(topology_task_handle);
+}
+
+void topology_child_connected(const uint8_t* mac) {
+    xSemaphoreTake(topology_lock, portMAX_DELAY);
+    topology_node_t* node = topology_get_node(mac, true);
+    if (node != NULL) {
+        node->parent = root_addr;
+        node->layer  = esp_mesh_get_layer() + 1;
+    }
+    xSemaphoreGive(topology_lock);
+    topology_routing_changed();
+}
+
+void topology_child_disconnected(const uint8_t* mac) {
+    topology_routing_changed();
+}
+
+void topology_node_report(const mesh_addr_t* node_addr,
+                          const mesh_addr_t* parent_addr,
+                          int                layer) {
+    xSemaphoreTake(topology_lock, portMAX_DELAY);
+    topology_node_t* node = topology_get_node(node_addr->addr, true);
+    if (node != NULL) {
+        node->parent  = *parent_addr;
+        node->layer   = layer;
+        node->present = true;
+    }
+    xSemaphoreGive(topology_lock);
+    xTaskNotifyGive(topology_task_handle);
+}
+
+bool topology_get_position(const mesh_addr_t* node_addr,
+                           mesh_addr_t*       parent_addr,
+                           int*               layer) {
+    bool found = false;
+    xSemaphoreTake(topology_lock, portMAX_DELAY);
+    topology_node_t* node = topology_get_node(node_addr->addr, false);
+    if (node != NULL && node->layer > 0) {
+        *parent_addr = node->parent;
+        *layer       = node->layer;
+        found        = true;
+    }
+    xSemaphoreGive(topology_lock);
+    return found;
+}
+
+void topology_request_full(void) {
+    xSemaphoreTake(topology_lock, portMAX_DELAY);
+    full_requested = true;
+    xSemaphoreGive(topology_lock);
+    topology_routing_changed();
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "esp_mesh.h"
+
+#define TOPOLOGY_MAX_NODES 64
+#define TOPOLOGY_SETTLE_MS 500
+
+/* Nodes report {"action":"topology","parent":"<ID>","layer":n} */
+#define TOPOLOGY_REPORT_PREFIX "{\"action\":\"topology\""
+
+/* Start the topology task, diffs are published once changes settle */
+void topology_init(void);
+
+/* The routing table of the root changed, it is read again by the task */
+void topology_routing_changed(void);
+
+/* A direct child of the root (dis)connected */
+void topology_child_connected(const uint8_t* mac);
+void topology_child_disconnected(const uint8_t* mac);
+
+/* A node reported its parent (station MAC) and layer */
+void topology_node_report(const mesh_addr_t* node_addr,
+                          const mesh_addr_t* parent_addr,
+                          int                layer);
+
+/* Parent and layer of a node, false if it has not reported them */
+bool topology_get_position(const mesh_addr_t* node_addr,
+                           mesh_addr_t*       parent_addr,
+                           int*               layer);
+
+/* Publish every known node on the next run instead of a diff */
+void topology_request_full(void);